@@ -0,0 +1,676 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "block_cache.h"
+
+/*Replacement follows 2Q. A block seen for the first time goes to */
+/*A1in, a FIFO holding about a quarter of the cache. Blocks pushed */
+/*out of A1in leave their number in A1out, a ghost queue without   */
+/*data. A block that comes back while still remembered there has   */
+/*been used twice and goes to Am, an LRU queue holding the rest. A  */
+/*long scan therefore only churns A1in and never flushes Am         */
+#define Q_FREE  0
+#define Q_A1IN  1
+#define Q_AM    2
+#define Q_A1OUT 3
+
+typedef struct cache_entry {
+    int block;
+    int queue;
+    int dirty;
+    int pins;
+    char* data;                        /*NULL for A1out ghosts*/
+    struct cache_entry *prev, *next;   /*queue links*/
+    struct cache_entry *hnext;         /*hash chain*/
+} cache_entry;
+
+typedef struct {
+    cache_entry *head, *tail;
+    int len;
+} cache_queue;
+
+struct block_cache {
+    disk_t* disk;
+    int block_size;
+    int nblocks;
+    int kin, kout;
+
+    /*nblocks resident entries followed by kout ghost entries*/
+    cache_entry* entries;
+    char* slab;
+    char* staging;             /*DISK_QUEUE_DEPTH blocks for multi-block prefetch*/
+    cache_entry** hash;
+    unsigned hash_mask;
+
+    cache_queue free, ghost_free;
+    cache_queue a1in, am, a1out;
+    cache_stats stats;
+};
+
+/*---------------------------------------------------------------*/
+/*Queue helpers, the head is the most recently inserted entry     */
+/*---------------------------------------------------------------*/
+static void q_push(cache_queue *q, cache_entry *e)
+{
+    e->prev = NULL;
+    e->next = q->head;
+    if (q->head != NULL)
+        q->head->prev = e;
+    else
+        q->tail = e;
+    q->head = e;
+    q->len++;
+}
+
+static void q_remove(cache_queue *q, cache_entry *e)
+{
+    if (e->prev != NULL)
+        e->prev->next = e->next;
+    else
+        q->head = e->next;
+    if (e->next != NULL)
+        e->next->prev = e->prev;
+    else
+        q->tail = e->prev;
+    e->prev = e->next = NULL;
+    q->len--;
+}
+
+static cache_queue* queue_of(block_cache_t *cache, cache_entry *e)
+{
+    switch (e->queue)
+    {
+    case Q_A1IN:
+        return &cache->a1in;
+    case Q_AM:
+        return &cache->am;
+    case Q_A1OUT:
+        return &cache->a1out;
+    }
+    return e->data != NULL ? &cache->free : &cache->ghost_free;
+}
+
+/*---------------------------------------------------------------*/
+/*Hash table from block number to entry (resident or ghost)       */
+/*---------------------------------------------------------------*/
+static cache_entry* hash_find(block_cache_t *cache, int block)
+{
+    cache_entry *e;
+
+    for (e = cache->hash[(unsigned)block & cache->hash_mask]; e != NULL; e = e->hnext)
+    {
+        if (e->block == block)
+            return e;
+    }
+    return NULL;
+}
+
+static void hash_insert(block_cache_t *cache, cache_entry *e)
+{
+    cache_entry **slot = &cache->hash[(unsigned)e->block & cache->hash_mask];
+
+    e->hnext = *slot;
+    *slot = e;
+}
+
+static void hash_remove(block_cache_t *cache, cache_entry *e)
+{
+    cache_entry **slot = &cache->hash[(unsigned)e->block & cache->hash_mask];
+
+    while (*slot != e)
+        slot = &(*slot)->hnext;
+    *slot = e->hnext;
+}
+
+/*---------------------------------------------------------------*/
+/*Moves an entry (out of whatever queue it is on) to another queue*/
+/*---------------------------------------------------------------*/
+static void move_to(block_cache_t *cache, cache_entry *e, int queue)
+{
+    q_remove(queue_of(cache, e), e);
+    e->queue = queue;
+    q_push(queue_of(cache, e), e);
+}
+
+/*---------------------------------------------------------------*/
+/*Forgets a resident block, its buffer becomes free               */
+/*---------------------------------------------------------------*/
+static void drop(block_cache_t *cache, cache_entry *e)
+{
+    hash_remove(cache, e);
+    move_to(cache, e, Q_FREE);
+    e->dirty = 0;
+    e->pins = 0;
+}
+
+/*---------------------------------------------------------------*/
+/*Remembers the number of a block evicted from A1in               */
+/*---------------------------------------------------------------*/
+static void remember(block_cache_t *cache, int block)
+{
+    cache_entry *g;
+
+    if (cache->kout == 0)
+        return;
+    if (cache->ghost_free.len > 0)
+        g = cache->ghost_free.head;
+    else
+    {
+        g = cache->a1out.tail;
+        hash_remove(cache, g);
+    }
+    g->block = block;
+    move_to(cache, g, Q_A1OUT);
+    hash_insert(cache, g);
+}
+
+/*---------------------------------------------------------------*/
+/*Least recently queued unpinned entry of a queue                 */
+/*---------------------------------------------------------------*/
+static cache_entry* victim(cache_queue *q)
+{
+    cache_entry *e;
+
+    for (e = q->tail; e != NULL; e = e->prev)
+    {
+        if (e->pins == 0)
+            return e;
+    }
+    return NULL;
+}
+
+/*---------------------------------------------------------------*/
+/*Writes one dirty block back                                     */
+/*---------------------------------------------------------------*/
+static int write_back(block_cache_t *cache, cache_entry *e)
+{
+    if (disk_write(cache->disk, e->block, 1, e->data) < 0)
+    {
+        printf("Could not write back block %d\n", e->block);
+        return -1;
+    }
+    e->dirty = 0;
+    cache->stats.writebacks++;
+    return 0;
+}
+
+/*---------------------------------------------------------------*/
+/*Finds a buffer for a new block, evicting one if none is free.   */
+/*Returns NULL when every buffer is pinned or the victim could    */
+/*not be written back, each reported apart                        */
+/*---------------------------------------------------------------*/
+static cache_entry* reclaim(block_cache_t *cache)
+{
+    cache_entry *e = NULL;
+
+    if (cache->free.len > 0)
+        return cache->free.head;
+
+    /*Blocks used once go first, as long as A1in is over its share*/
+    if (cache->a1in.len > cache->kin)
+        e = victim(&cache->a1in);
+    if (e == NULL)
+        e = victim(&cache->am);
+    if (e == NULL)
+        e = victim(&cache->a1in);
+    if (e == NULL)
+    {
+        printf("Block cache is full of pinned blocks\n");
+        return NULL;
+    }
+
+    if (e->dirty && write_back(cache, e) == -1)
+        return NULL;
+    if (e->queue == Q_A1IN)
+        remember(cache, e->block);
+    drop(cache, e);
+    cache->stats.evictions++;
+    return e;
+}
+
+/*---------------------------------------------------------------*/
+/*Looks a block up, making room for it on a miss. miss tells the  */
+/*caller whether the buffer still has to be filled                */
+/*---------------------------------------------------------------*/
+static cache_entry* load(block_cache_t *cache, int block, int *miss)
+{
+    cache_entry *e = hash_find(cache, block);
+    int queue = Q_A1IN;
+
+    if (e != NULL && e->queue != Q_A1OUT)
+    {
+        /*A1in is a plain FIFO, only Am tracks recency*/
+        if (e->queue == Q_AM)
+            move_to(cache, e, Q_AM);
+        cache->stats.hits++;
+        *miss = 0;
+        return e;
+    }
+
+    /*Seen recently enough to count as a second use*/
+    if (e != NULL)
+    {
+        hash_remove(cache, e);
+        move_to(cache, e, Q_FREE);
+        queue = Q_AM;
+    }
+
+    e = reclaim(cache);
+    if (e == NULL)
+        return NULL;
+    e->block = block;
+    e->dirty = 0;
+    e->pins = 0;
+    move_to(cache, e, queue);
+    hash_insert(cache, e);
+    cache->stats.misses++;
+    *miss = 1;
+    return e;
+}
+
+/*---------------------------------------------------------------*/
+/*Creates a cache of nblocks blocks in front of a disk            */
+/*---------------------------------------------------------------*/
+block_cache_t* cache_create(disk_t *disk, int nblocks)
+{
+    block_cache_t *cache;
+    unsigned buckets = 1;
+    int i;
+
+    if (nblocks < 2)
+        nblocks = 2;
+    cache = calloc(1, sizeof(block_cache_t));
+    if (cache == NULL)
+        return NULL;
+
+    cache->disk = disk;
+    cache->block_size = disk_block_size(disk);
+    cache->nblocks = nblocks;
+    cache->kin = nblocks / 4 > 0 ? nblocks / 4 : 1;
+    cache->kout = nblocks / 2;
+
+    while (buckets < 2 * (unsigned)(nblocks + cache->kout))
+        buckets <<= 1;
+    cache->hash_mask = buckets - 1;
+    cache->hash = calloc(buckets, sizeof(cache_entry*));
+    cache->entries = calloc(nblocks + cache->kout, sizeof(cache_entry));
+    if (cache->hash == NULL || cache->entries == NULL ||
+        posix_memalign((void**)&cache->slab, DISK_ALIGN, (size_t)nblocks * cache->block_size) != 0)
+    {
+        free(cache->hash);
+        free(cache->entries);
+        free(cache);
+        return NULL;
+    }
+    if (posix_memalign((void**)&cache->staging, DISK_ALIGN, (size_t)DISK_QUEUE_DEPTH * cache->block_size) != 0)
+    {
+        free(cache->slab);
+        free(cache->hash);
+        free(cache->entries);
+        free(cache);
+        return NULL;
+    }
+
+    for (i = 0; i < nblocks + cache->kout; i++)
+    {
+        cache->entries[i].block = -1;
+        cache->entries[i].queue = Q_FREE;
+        if (i < nblocks)
+        {
+            cache->entries[i].data = cache->slab + (size_t)i * cache->block_size;
+            q_push(&cache->free, &cache->entries[i]);
+        }
+        else
+            q_push(&cache->ghost_free, &cache->entries[i]);
+    }
+    return cache;
+}
+
+/*---------------------------------------------------------------*/
+/*Writes back everything dirty and releases the cache. The disk   */
+/*stays open                                                      */
+/*---------------------------------------------------------------*/
+int cache_destroy(block_cache_t *cache)
+{
+    int ret;
+
+    if (cache == NULL)
+        return 0;
+    ret = cache_flush(cache);
+    free(cache->slab);
+    free(cache->staging);
+    free(cache->entries);
+    free(cache->hash);
+    free(cache);
+    return ret;
+}
+
+/*---------------------------------------------------------------*/
+/*Returns the cached copy of a block, reading it on a miss. The   */
+/*block stays pinned (never evicted) until the matching cache_put.*/
+/*On a mapped image the block is used in place, zeroed first with */
+/*CACHE_NOREAD like a buffer handed out on a miss                 */
+/*---------------------------------------------------------------*/
+void* cache_get(block_cache_t *cache, int block, int flags)
+{
+    cache_entry *e;
+    void* mapped;
+    int miss;
+
+    mapped = disk_block_ptr(cache->disk, block);
+    if (mapped != NULL)
+    {
+        if (flags & CACHE_NOREAD)
+            memset(mapped, 0, cache->block_size);
+        return mapped;
+    }
+
+    e = load(cache, block, &miss);
+    if (e == NULL)
+        return NULL;
+    if (miss)
+    {
+        if (flags & CACHE_NOREAD)
+            memset(e->data, 0, cache->block_size);
+        else if (disk_read(cache->disk, block, 1, e->data) < 0)
+        {
+            drop(cache, e);
+            return NULL;
+        }
+    }
+    e->pins++;
+    return e->data;
+}
+
+/*---------------------------------------------------------------*/
+/*Unpins a block from cache_get. dirty says it was modified and   */
+/*has to reach the disk before its buffer is reused               */
+/*---------------------------------------------------------------*/
+void cache_put(block_cache_t *cache, int block, int dirty)
+{
+    cache_entry *e = hash_find(cache, block);
+
+    if (e == NULL || e->queue == Q_A1OUT)
+        return;
+    if (e->pins > 0)
+        e->pins--;
+    if (dirty)
+        e->dirty = 1;
+}
+
+/*---------------------------------------------------------------*/
+/*Copies consecutive blocks out of the cache                      */
+/*---------------------------------------------------------------*/
+int cache_read(block_cache_t *cache, int block, int nblocks, void *buffer)
+{
+    int blocks[DISK_QUEUE_DEPTH];
+    char* data;
+    int i;
+
+    if (nblocks <= 0)
+        return 0;
+    for (i = 0; i < nblocks && i < DISK_QUEUE_DEPTH; i++)
+        blocks[i] = block + i;
+    cache_prefetch(cache, blocks, i);
+
+    for (i = 0; i < nblocks; i++)
+    {
+        data = cache_get(cache, block + i, 0);
+        if (data == NULL)
+            return -1;
+        memcpy((char*)buffer + (size_t)i * cache->block_size, data, cache->block_size);
+        cache_put(cache, block + i, 0);
+    }
+    return nblocks;
+}
+
+/*---------------------------------------------------------------*/
+/*Reads consecutive blocks straight into buffer with one request, */
+/*without caching them. Cached copies, which may be newer than the*/
+/*disk, are laid over what was read. Returns nblocks, or -1       */
+/*---------------------------------------------------------------*/
+int cache_read_direct(block_cache_t *cache, int block, int nblocks, void *buffer)
+{
+    cache_entry *e;
+    int i;
+
+    if (disk_read(cache->disk, block, nblocks, buffer) < nblocks)
+        return -1;
+
+    for (i = 0; i < nblocks; i++)
+    {
+        e = hash_find(cache, block + i);
+        if (e == NULL || e->queue == Q_A1OUT)
+            continue;
+        if (e->queue == Q_AM)
+            move_to(cache, e, Q_AM);
+        cache->stats.hits++;
+        memcpy((char*)buffer + (size_t)i * cache->block_size, e->data, cache->block_size);
+    }
+    return nblocks;
+}
+
+/*---------------------------------------------------------------*/
+/*Writes buffer over consecutive blocks straight to the disk with */
+/*one request, for callers replacing whole blocks. Cached copies  */
+/*get the new contents and stay dirty only if the write failed.   */
+/*Returns nblocks, or -1                                          */
+/*---------------------------------------------------------------*/
+int cache_write_direct(block_cache_t *cache, int block, int nblocks, const void *buffer)
+{
+    cache_entry *e;
+    int i, failed;
+
+    failed = disk_write(cache->disk, block, nblocks, (void*)buffer) < nblocks;
+
+    for (i = 0; i < nblocks; i++)
+    {
+        e = hash_find(cache, block + i);
+        if (e == NULL || e->queue == Q_A1OUT)
+            continue;
+        memcpy(e->data, (const char*)buffer + (size_t)i * cache->block_size, cache->block_size);
+        e->dirty = failed;
+    }
+    return failed ? -1 : nblocks;
+}
+
+/*---------------------------------------------------------------*/
+/*Copies consecutive blocks into the cache, they reach the disk on*/
+/*eviction or the next flush                                      */
+/*---------------------------------------------------------------*/
+int cache_write(block_cache_t *cache, int block, int nblocks, const void *buffer)
+{
+    char* data;
+    int i;
+
+    for (i = 0; i < nblocks; i++)
+    {
+        data = cache_get(cache, block + i, CACHE_NOREAD);
+        if (data == NULL)
+            return -1;
+        memcpy(data, (const char*)buffer + (size_t)i * cache->block_size, cache->block_size);
+        cache_put(cache, block + i, 1);
+    }
+    return nblocks;
+}
+
+/*---------------------------------------------------------------*/
+/*Brings a set of blocks in with all the reads in flight together.*/
+/*Runs of consecutive block numbers go out as one multi-block     */
+/*request. At most half the cache is filled this way. Returns the */
+/*number of blocks read                                           */
+/*---------------------------------------------------------------*/
+int cache_prefetch(block_cache_t *cache, const int *blocks, int n)
+{
+    disk_request reqs[DISK_QUEUE_DEPTH];
+    cache_entry* loaded[DISK_QUEUE_DEPTH];
+    int first[DISK_QUEUE_DEPTH];
+    cache_entry *e;
+    disk_request *run;
+    int i, j, k, nreqs, nloaded, miss, full = 0, total = 0;
+
+    if (n > cache->nblocks / 2)
+        n = cache->nblocks / 2;
+
+    for (i = 0; i < n && !full; )
+    {
+        /*Start reads for the next DISK_QUEUE_DEPTH misses. A miss right*/
+        /*after the last block of the previous request extends it       */
+        for (nreqs = 0, nloaded = 0; i < n && nloaded < DISK_QUEUE_DEPTH; i++)
+        {
+            if (disk_block_ptr(cache->disk, blocks[i]) != NULL)
+                continue;
+            e = hash_find(cache, blocks[i]);
+            if (e != NULL && e->queue != Q_A1OUT)
+                continue;
+            e = load(cache, blocks[i], &miss);
+            if (e == NULL)
+            {
+                full = 1;
+                break;
+            }
+            e->pins++;
+            run = nreqs > 0 ? &reqs[nreqs - 1] : NULL;
+            if (run != NULL && first[nreqs - 1] + run->nblocks == nloaded &&
+                run->start_address + run->nblocks == blocks[i])
+                run->nblocks++;
+            else
+            {
+                first[nreqs] = nloaded;
+                reqs[nreqs] = (disk_request) { DISK_READ, blocks[i], 1, e->data };
+                nreqs++;
+            }
+            loaded[nloaded++] = e;
+        }
+        if (nreqs == 0)
+            break;
+
+        /*Cached blocks are not adjacent in memory, a run is read into */
+        /*the staging buffer and copied out                             */
+        for (j = 0; j < nreqs; j++)
+            if (reqs[j].nblocks > 1)
+                reqs[j].buffer = cache->staging + (size_t)first[j] * cache->block_size;
+
+        disk_submit(cache->disk, reqs, nreqs);
+        disk_wait(cache->disk, reqs, nreqs);
+        for (j = 0; j < nreqs; j++)
+        {
+            for (k = first[j]; k < first[j] + reqs[j].nblocks; k++)
+            {
+                loaded[k]->pins--;
+                if (reqs[j].result < reqs[j].nblocks)
+                {
+                    drop(cache, loaded[k]);
+                    continue;
+                }
+                if (reqs[j].nblocks > 1)
+                    memcpy(loaded[k]->data, cache->staging + (size_t)k * cache->block_size, cache->block_size);
+                total++;
+            }
+        }
+    }
+    return total;
+}
+
+/*---------------------------------------------------------------*/
+/*Forgets a block without writing it back, for freed blocks whose */
+/*contents do not matter anymore                                  */
+/*---------------------------------------------------------------*/
+void cache_discard(block_cache_t *cache, int block)
+{
+    cache_entry *e = hash_find(cache, block);
+
+    if (e != NULL && e->queue != Q_A1OUT && e->pins == 0)
+        drop(cache, e);
+}
+
+static int by_block(const void *a, const void *b)
+{
+    return (*(cache_entry* const*)a)->block - (*(cache_entry* const*)b)->block;
+}
+
+/*---------------------------------------------------------------*/
+/*Writes every dirty block back, in block order and              */
+/*DISK_QUEUE_DEPTH blocks at a time. Consecutive dirty blocks go  */
+/*out as one request through the staging buffer. The blocks stay  */
+/*cached                                                          */
+/*---------------------------------------------------------------*/
+int cache_flush(block_cache_t *cache)
+{
+    disk_request reqs[DISK_QUEUE_DEPTH];
+    int first[DISK_QUEUE_DEPTH];
+    cache_entry** dirty;
+    int i, j, k, n = 0, ret = 0;
+
+    dirty = malloc(cache->nblocks * sizeof(cache_entry*));
+    if (dirty == NULL)
+        return -1;
+    for (i = 0; i < cache->nblocks; i++)
+    {
+        if (cache->entries[i].queue != Q_FREE && cache->entries[i].dirty)
+            dirty[n++] = &cache->entries[i];
+    }
+    qsort(dirty, n, sizeof(cache_entry*), by_block);
+
+    for (i = 0; i < n; i += DISK_QUEUE_DEPTH)
+    {
+        int count = n - i < DISK_QUEUE_DEPTH ? n - i : DISK_QUEUE_DEPTH;
+        int nreqs = 0;
+
+        for (j = 0; j < count; j++)
+        {
+            if (nreqs > 0 && reqs[nreqs - 1].start_address + reqs[nreqs - 1].nblocks == dirty[i + j]->block)
+            {
+                /*Extending a run moves it, and what it has so far, to staging*/
+                if (reqs[nreqs - 1].nblocks == 1)
+                {
+                    reqs[nreqs - 1].buffer = cache->staging + (size_t)first[nreqs - 1] * cache->block_size;
+                    memcpy(reqs[nreqs - 1].buffer, dirty[i + j - 1]->data, cache->block_size);
+                }
+                memcpy(cache->staging + (size_t)j * cache->block_size, dirty[i + j]->data, cache->block_size);
+                reqs[nreqs - 1].nblocks++;
+                continue;
+            }
+            first[nreqs] = j;
+            reqs[nreqs++] = (disk_request) { DISK_WRITE, dirty[i + j]->block, 1, dirty[i + j]->data };
+        }
+        disk_submit(cache->disk, reqs, nreqs);
+        disk_wait(cache->disk, reqs, nreqs);
+        for (j = 0; j < nreqs; j++)
+        {
+            if (reqs[j].result < reqs[j].nblocks)
+            {
+                printf("Could not write back block %d\n", reqs[j].start_address);
+                ret = -1;
+                continue;
+            }
+            for (k = first[j]; k < first[j] + reqs[j].nblocks; k++)
+            {
+                dirty[i + k]->dirty = 0;
+                cache->stats.writebacks++;
+            }
+        }
+    }
+    free(dirty);
+    return ret;
+}
+
+/*---------------------------------------------------------------*/
+/*Flushes the cache and makes everything durable                  */
+/*---------------------------------------------------------------*/
+int cache_sync(block_cache_t *cache)
+{
+    int ret = cache_flush(cache);
+
+    if (disk_sync(cache->disk) == -1)
+        ret = -1;
+    return ret;
+}
+
+/*---------------------------------------------------------------*/
+/*Copies the counters of a cache                                  */
+/*---------------------------------------------------------------*/
+void cache_get_stats(block_cache_t *cache, cache_stats *stats)
+{
+    *stats = cache->stats;
+}
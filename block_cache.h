@@ -0,0 +1,37 @@
+#ifndef _INCLUDE_BLOCK_CACHE_H_
+#define _INCLUDE_BLOCK_CACHE_H_
+
+#include <stdint.h>
+#include "disk_emu.h"
+
+// Flags of cache_get()
+// CACHE_NOREAD  the caller overwrites the whole block, a miss (or any
+//               block of a mapped image) hands out a zeroed buffer
+//               instead of reading the disk
+#define CACHE_NOREAD 1
+
+// A write-back cache of disk blocks, see cache_create()
+typedef struct block_cache block_cache_t;
+
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t writebacks;       // dirty blocks written to disk
+} cache_stats;
+
+block_cache_t* cache_create(disk_t *disk, int nblocks);
+int cache_destroy(block_cache_t *cache);
+void* cache_get(block_cache_t *cache, int block, int flags);
+void cache_put(block_cache_t *cache, int block, int dirty);
+int cache_read(block_cache_t *cache, int block, int nblocks, void *buffer);
+int cache_read_direct(block_cache_t *cache, int block, int nblocks, void *buffer);
+int cache_write(block_cache_t *cache, int block, int nblocks, const void *buffer);
+int cache_write_direct(block_cache_t *cache, int block, int nblocks, const void *buffer);
+int cache_prefetch(block_cache_t *cache, const int *blocks, int n);
+void cache_discard(block_cache_t *cache, int block);
+int cache_flush(block_cache_t *cache);
+int cache_sync(block_cache_t *cache);
+void cache_get_stats(block_cache_t *cache, cache_stats *stats);
+
+#endif //_INCLUDE_BLOCK_CACHE_H_
@@ -1,180 +1,1499 @@
-#include <stdio.h>
-#include <stdlib.h> 
-#include <string.h>
-#include <unistd.h>
-#include <time.h>
-#include "disk_emu.h"
-
-
-FILE* fp = NULL;
-double L, p;
-double r;
-int BLOCK_SIZE, MAX_BLOCK, MAX_RETRY, lru;
-
-/*----------------------------------------------------------*/
-/*Close the disk file filled when you don't need it anymore. */
-/*----------------------------------------------------------*/
-int close_disk()
-{
-    if(NULL != fp)
-    {
-        fclose(fp);
-    }
-    return 0;
-}
-
-/*---------------------------------------*/
-/*Initializes a disk file filled with 0's*/
-/*---------------------------------------*/
-int init_fresh_disk(char *filename, int block_size, int num_blocks)
-{
-    int i, j;
-    
-    /*Set up latency at 0.02 second*/
-    L = 00000.f;
-    /*Set up failure at 10%*/
-    p = -1.f;
-    /*Set up max retry attempts after failure to 3*/
-    MAX_RETRY = 3;
-
-    BLOCK_SIZE = block_size;
-    MAX_BLOCK = num_blocks;
-    
-    /*Initializes the random number generator*/
-    srand((unsigned int)(time( 0 )) );
-    /*Creates a new file*/
-    fp = fopen (filename, "w+b");
-
-    if (fp == NULL)
-    {
-        printf("Could not create new disk file %s\n\n", filename);
-        return -1;
-    }
-    
-    /*Fills the file with 0's to its given size*/
-    for (i = 0; i < MAX_BLOCK; i++)
-    {
-        for (j = 0; j < BLOCK_SIZE; j++)
-        {
-            fputc(0, fp);
-        }
-    }
-    return 0;
-}
-/*----------------------------*/
-/*Initializes an existing disk*/
-/*----------------------------*/
-int init_disk(char *filename, int block_size, int num_blocks)
-{
-    /*Set up latency at 0.02 second*/
-    L = 00000.f;
-    /*Set up failure at 10%*/
-    p = -1.f;
-    /*Set up max retry attempts after failure to 3*/
-    MAX_RETRY = 3;
-
-    BLOCK_SIZE = block_size;
-    MAX_BLOCK = num_blocks;
-    
-    /*Initializes the random number generator*/
-    srand((unsigned int)(time( 0 )) );
-    
-    /*Opens a file*/
-    fp = fopen (filename, "r+b");
-
-    if (fp == NULL)
-    {
-        printf("Could not open %s\n\n", filename);
-        return -1;
-    }
-    return 0;
-}
-
-/*-------------------------------------------------------------------*/
-/*Reads a series of blocks from the disk into the buffer             */
-/*-------------------------------------------------------------------*/
-int read_blocks(int start_address, int nblocks, void *buffer)
-{
-    int i, j, e, s;
-    e = 0;
-    s = 0;
-
-    /*Sets up a temporary buffer*/
-    void* blockRead = (void*) malloc(BLOCK_SIZE);
-
-    /*Checks that the data requested is within the range of addresses of the disk*/
-    if (start_address + nblocks > MAX_BLOCK)
-    {
-        printf("out of bound error %d\n", start_address);
-        return -1;
-    }
-
-    /*Goto the data requested from the disk*/
-    fseek(fp, start_address * BLOCK_SIZE, SEEK_SET);
-
-    /*For every block requested*/
-    for (i = 0; i < nblocks; ++i)
-    {
-        /*Pause until the latency duration is elapsed*/
-        // usleep(L);
-
-        s++;
-        fread(blockRead, BLOCK_SIZE, 1, fp);
-
-       for (j = 0; j < BLOCK_SIZE; j++)
-        {
-            memcpy(buffer+(i*BLOCK_SIZE), blockRead, BLOCK_SIZE);  
-        }
-    }
-
-    free(blockRead);
-
-
-    /*If no failure return the number of blocks read, else return the negative number of failures*/
-    if (e == 0)
-        return s;
-    else
-        return e;
-}
-
-/*------------------------------------------------------------------*/
-/*Writes a series of blocks to the disk from the buffer             */
-/*------------------------------------------------------------------*/
-int write_blocks(int start_address, int nblocks, void *buffer)
-{
-    int i, e, s;
-    e = 0;
-    s = 0;
-
-    void* blockWrite = (void*) malloc(BLOCK_SIZE);
-
-    /*Checks that the data requested is within the range of addresses of the disk*/
-    if (start_address + nblocks > MAX_BLOCK)
-    {
-        printf("out of bound error\n");
-        return -1;
-    }
-
-    /*Goto where the data is to be written on the disk*/        
-    fseek(fp, start_address * BLOCK_SIZE, SEEK_SET);
-
-    /*For every block requested*/        
-    for (i = 0; i < nblocks; ++i)
-    {
-        /*Pause until the latency duration is elapsed*/
-        usleep(L);
-
-        memcpy(blockWrite, buffer+(i*BLOCK_SIZE), BLOCK_SIZE);
-
-        fwrite(blockWrite, BLOCK_SIZE, 1, fp);
-        fflush(fp);
-        s++;
-    }
-    free(blockWrite);
-
-    /*If no failure return the number of blocks written, else return the negative number of failures*/
-    if (e == 0)
-        return s;
-    else
-        return e;
-}
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "disk_emu.h"
+
+/*linux/fs.h (pulled in by io_uring.h) has its own BLOCK_SIZE*/
+#undef BLOCK_SIZE
+
+/*Aligned single block buffers owned by each disk, see            */
+/*disk_get_buffer. They are carved out of one slab                  */
+#define POOL_BUFFERS (2 * DISK_QUEUE_DEPTH)
+
+/*Everything about one open volume. Nothing is shared between two  */
+/*disks, so each one can be driven from its own thread              */
+struct disk {
+    int block_size;
+    int max_block;
+    int mode;
+    int direct;
+
+    /*Image files making up the volume. Logical blocks are dealt out*/
+    /*round-robin to the members, stripe_unit blocks at a time. Each*/
+    /*member holds member_blocks blocks                              */
+    int members;
+    int member_fd[DISK_MAX_MEMBERS];
+    char* member_image[DISK_MAX_MEMBERS];
+    int member_blocks;
+    int stripe_unit;
+
+    /*Each queue slot remembers when the device is done with its     */
+    /*current request, head is the block following the previous one */
+    disk_model model;
+    int timed;
+    double slot_free[DISK_QUEUE_DEPTH];
+    int head;
+    unsigned int seed;
+
+    /*Counters and the optional trace file. last_block follows the  */
+    /*previous request to tell sequential from random access, dirty */
+    /*counts bytes written since the last durability barrier        */
+    disk_stats stats;
+    int last_block;
+    uint64_t dirty;
+    FILE* trace;
+
+    struct {
+        char* slab;
+        void* free_list[POOL_BUFFERS];
+        int nfree;
+    } pool;
+
+    /*Submission/completion rings shared with the kernel. ring_fd is*/
+    /*-1 when io_uring is unavailable, requests then complete inline.*/
+    /*Requests failing every attempt are never issued, they wait on  */
+    /*the failed list until the modeled device would give up on them */
+    struct {
+        int ring_fd;
+        unsigned entries;
+        unsigned inflight;
+        disk_request *failed;
+        unsigned nfailed;
+        unsigned *sq_tail, *sq_mask, *sq_array;
+        unsigned *cq_head, *cq_tail, *cq_mask;
+        struct io_uring_sqe *sqes;
+        struct io_uring_cqe *cqes;
+        void *sq_ring, *cq_ring;
+        size_t sq_ring_size, cq_ring_size;
+    } ring;
+};
+
+/*Timing and failure presets, see disk_config*/
+const disk_model DISK_MODEL_NONE = { 0 };
+const disk_model DISK_MODEL_HDD = {
+    .overhead_us = 50, .seek_us = 4000, .seek_us_per_block = 0.005, .max_seek_us = 12000,
+    .bandwidth = 150, .queue_depth = 1, .failure_p = 0, .max_retry = 3 };
+const disk_model DISK_MODEL_SSD = {
+    .overhead_us = 80, .seek_us = 0, .seek_us_per_block = 0, .max_seek_us = 0,
+    .bandwidth = 2000, .queue_depth = DISK_QUEUE_DEPTH, .failure_p = 0, .max_retry = 3 };
+
+/*Settings for init_fresh_disk/init_disk, and the disk they opened.*/
+/*The rest of the single disk API works on that disk                */
+static disk_config default_config = { DISK_PIO, DISK_STRIPE_UNIT, { 0 } };
+static disk_t* default_disk = NULL;
+
+/*---------------------------------------------------------------*/
+/*Finds the member holding a logical block and the block's index */
+/*within that member. Returns how many blocks follow contiguously*/
+/*on the member, up to the end of the stripe unit                */
+/*---------------------------------------------------------------*/
+static int locate(disk_t *disk, int block, int *member, off_t *member_block)
+{
+    int stripe;
+
+    if (disk->members == 1)
+    {
+        *member = 0;
+        *member_block = block;
+        return disk->max_block - block;
+    }
+    stripe = block / disk->stripe_unit;
+    *member = stripe % disk->members;
+    *member_block = (off_t)(stripe / disk->members) * disk->stripe_unit + block % disk->stripe_unit;
+    return disk->stripe_unit - block % disk->stripe_unit;
+}
+
+/*---------------------------------------------------------------*/
+/*Puts the selected model in charge of a freshly opened image     */
+/*---------------------------------------------------------------*/
+static void start_model(disk_t *disk, const disk_model *model)
+{
+    disk->model = *model;
+    if (disk->model.queue_depth <= 0 || disk->model.queue_depth > DISK_QUEUE_DEPTH)
+        disk->model.queue_depth = DISK_QUEUE_DEPTH;
+    if (disk->model.max_retry < 0)
+        disk->model.max_retry = 0;
+    disk->timed = model->overhead_us > 0 || model->seek_us > 0 || model->seek_us_per_block > 0 ||
+                  model->bandwidth > 0 || model->failure_p > 0;
+
+    /*Initializes the random number generator, one per disk. A model*/
+    /*with a seed of its own fails the same requests on every run    */
+    disk->seed = model->seed;
+    if (disk->seed == 0)
+        disk->seed = (unsigned int)time(0) ^ (unsigned int)(unsigned long)disk;
+}
+
+/*---------------------------------------------------------------*/
+/*Monotonic clock in microseconds                                 */
+/*---------------------------------------------------------------*/
+static double now_us()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/*---------------------------------------------------------------*/
+/*Sleeps until the modeled device finishes a request              */
+/*---------------------------------------------------------------*/
+static void wait_until(double due)
+{
+    double now = now_us();
+
+    if (due > now)
+        usleep((useconds_t)(due - now));
+}
+
+/*---------------------------------------------------------------*/
+/*Appends a record to the trace file, if one is open              */
+/*---------------------------------------------------------------*/
+static void trace_request(disk_t *disk, int op, int start_address, int nblocks, int result, double issued, double done)
+{
+    disk_trace_record rec;
+
+    if (disk->trace == NULL)
+        return;
+    memset(&rec, 0, sizeof(rec));
+    rec.timestamp_us = (uint64_t)issued;
+    rec.latency_us = (uint32_t)(done - issued);
+    rec.start_address = start_address;
+    rec.nblocks = nblocks;
+    rec.result = result;
+    rec.op = op;
+    fwrite(&rec, sizeof(rec), 1, disk->trace);
+}
+
+/*---------------------------------------------------------------*/
+/*Updates the counters once a request completed                   */
+/*---------------------------------------------------------------*/
+static void account(disk_t *disk, int write, int start_address, int nblocks, int result, double issued)
+{
+    double done = now_us();
+    double latency = done - issued;
+    int bucket = 0;
+
+    if (write)
+    {
+        disk->stats.writes++;
+        if (result > 0)
+        {
+            disk->stats.blocks_written += result;
+            disk->dirty += (uint64_t)result * disk->block_size;
+        }
+    }
+    else
+    {
+        disk->stats.reads++;
+        if (result > 0)
+            disk->stats.blocks_read += result;
+    }
+    if (result < 0)
+        disk->stats.errors++;
+
+    if (start_address == disk->last_block)
+        disk->stats.sequential++;
+    else
+        disk->stats.random++;
+    disk->last_block = start_address + nblocks;
+
+    while (bucket < DISK_LAT_BUCKETS - 1 && latency >= 1)
+    {
+        latency /= 2;
+        bucket++;
+    }
+    disk->stats.latency[bucket]++;
+
+    trace_request(disk, write ? DISK_WRITE : DISK_READ, start_address, nblocks, result, issued, done);
+}
+
+/*---------------------------------------------------------------*/
+/*Counts a durability barrier covering up to nbytes written bytes */
+/*---------------------------------------------------------------*/
+static void account_sync(disk_t *disk, int start_address, int nblocks, uint64_t nbytes, double issued)
+{
+    if (nbytes > disk->dirty)
+        nbytes = disk->dirty;
+    disk->dirty -= nbytes;
+    disk->stats.syncs++;
+    disk->stats.bytes_flushed += nbytes;
+    trace_request(disk, DISK_TRACE_SYNC, start_address, nblocks, 0, issued, now_us());
+}
+
+/*---------------------------------------------------------------*/
+/*Books a request on the modeled device: overhead, a seek unless */
+/*it starts where the previous one ended, and the transfer itself.*/
+/*Failed attempts cost as much as good ones and are retried up to */
+/*max_retry times. Returns when the request completes, failures   */
+/*gets the number of failed attempts                              */
+/*---------------------------------------------------------------*/
+static double schedule_request(disk_t *disk, int start_address, int nblocks, int *failures)
+{
+    disk_model *model = &disk->model;
+    double service, seek, start, now = now_us();
+    int i, slot = 0, attempts;
+
+    service = model->overhead_us;
+    if (model->bandwidth > 0)
+        service += (double)nblocks * disk->block_size / model->bandwidth;
+    if (start_address != disk->head)
+    {
+        seek = model->seek_us + model->seek_us_per_block * abs(start_address - disk->head);
+        if (model->max_seek_us > 0 && seek > model->max_seek_us)
+            seek = model->max_seek_us;
+        service += seek;
+    }
+    disk->head = start_address + nblocks;
+
+    *failures = 0;
+    while (*failures <= model->max_retry && (double)rand_r(&disk->seed) / RAND_MAX < model->failure_p)
+        (*failures)++;
+    attempts = *failures > model->max_retry ? *failures : *failures + 1;
+
+    /*Up to queue_depth requests are serviced side by side*/
+    for (i = 1; i < model->queue_depth; i++)
+    {
+        if (disk->slot_free[i] < disk->slot_free[slot])
+            slot = i;
+    }
+    start = disk->slot_free[slot] > now ? disk->slot_free[slot] : now;
+    disk->slot_free[slot] = start + service * attempts;
+    return disk->slot_free[slot];
+}
+
+/*---------------------------------------------------------------*/
+/*Opens one image file, bypassing the page cache in DISK_DIRECT  */
+/*mode. File systems without O_DIRECT support fall back to       */
+/*buffered I/O                                                    */
+/*---------------------------------------------------------------*/
+static int open_member(disk_t *disk, char *filename, int flags)
+{
+    int fd = -1;
+
+    if (disk->mode == DISK_DIRECT)
+    {
+        fd = open(filename, flags | O_DIRECT, 0644);
+        if (fd != -1)
+            disk->direct = 1;
+        else if (errno == EINVAL)
+            printf("O_DIRECT not supported for %s, using buffered I/O\n", filename);
+    }
+    if (fd == -1)
+        fd = open(filename, flags, 0644);
+    return fd;
+}
+
+/*---------------------------------------------------------------*/
+/*Opens the image files. filename is a ':' separated list, with  */
+/*more than one entry the volume is striped across all of them   */
+/*---------------------------------------------------------------*/
+static int open_image(disk_t *disk, char *filename, int flags)
+{
+    char *names, *name, *save;
+    int i;
+
+    names = strdup(filename);
+    for (name = strtok_r(names, ":", &save); name != NULL; name = strtok_r(NULL, ":", &save))
+    {
+        if (disk->members == DISK_MAX_MEMBERS ||
+            (disk->member_fd[disk->members] = open_member(disk, name, flags)) == -1)
+        {
+            printf("Could not open disk file %s\n", name);
+            free(names);
+            return -1;
+        }
+        disk->members++;
+    }
+    free(names);
+    if (disk->members == 0)
+        return -1;
+
+    /*Every member is as large as its share of whole stripe rows*/
+    if (disk->members == 1)
+        disk->member_blocks = disk->max_block;
+    else
+        disk->member_blocks = (disk->max_block + disk->stripe_unit * disk->members - 1) /
+                              (disk->stripe_unit * disk->members) * disk->stripe_unit;
+
+    /*Set up the buffer pool now that the block size is known*/
+    if (posix_memalign((void**)&disk->pool.slab, DISK_ALIGN, (size_t)POOL_BUFFERS * disk->block_size) != 0)
+    {
+        disk->pool.slab = NULL;
+        return -1;
+    }
+    for (i = 0; i < POOL_BUFFERS; i++)
+        disk->pool.free_list[i] = disk->pool.slab + (size_t)i * disk->block_size;
+    disk->pool.nfree = POOL_BUFFERS;
+    return 0;
+}
+
+/*---------------------------------------------------------------*/
+/*Maps the whole image when running in DISK_MMAP mode            */
+/*---------------------------------------------------------------*/
+static int map_image(disk_t *disk)
+{
+    size_t size = (size_t)disk->member_blocks * disk->block_size;
+    struct stat st;
+    int m;
+
+    if (disk->mode != DISK_MMAP)
+        return 0;
+
+    for (m = 0; m < disk->members; m++)
+    {
+        /*Touching a page past the end of the file would SIGBUS*/
+        if (fstat(disk->member_fd[m], &st) == -1 ||
+            ((size_t)st.st_size < size && ftruncate(disk->member_fd[m], size) == -1))
+        {
+            printf("Could not size the disk image for mapping\n\n");
+            return -1;
+        }
+
+        disk->member_image[m] = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, disk->member_fd[m], 0);
+        if (disk->member_image[m] == MAP_FAILED)
+        {
+            disk->member_image[m] = NULL;
+            printf("Could not map the disk image\n\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*---------------------------------------------------------------*/
+/*Sets up an io_uring instance of DISK_QUEUE_DEPTH entries on the */
+/*image. Failing is not an error, requests then run synchronously */
+/*---------------------------------------------------------------*/
+static void setup_ring(disk_t *disk)
+{
+    struct io_uring_params params;
+    char* sq;
+    char* cq;
+
+    /*A mapped image is accessed with memcpy, nothing to queue*/
+    if (disk->member_image[0] != NULL)
+        return;
+
+    memset(&params, 0, sizeof(params));
+    disk->ring.ring_fd = syscall(__NR_io_uring_setup, DISK_QUEUE_DEPTH, &params);
+    if (disk->ring.ring_fd < 0)
+    {
+        disk->ring.ring_fd = -1;
+        return;
+    }
+
+    disk->ring.entries = params.sq_entries;
+    disk->ring.inflight = 0;
+    disk->ring.sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    disk->ring.cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    disk->ring.sq_ring = mmap(NULL, disk->ring.sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                              disk->ring.ring_fd, IORING_OFF_SQ_RING);
+    disk->ring.cq_ring = mmap(NULL, disk->ring.cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                              disk->ring.ring_fd, IORING_OFF_CQ_RING);
+    disk->ring.sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, disk->ring.ring_fd, IORING_OFF_SQES);
+    if (disk->ring.sq_ring == MAP_FAILED || disk->ring.cq_ring == MAP_FAILED || disk->ring.sqes == MAP_FAILED)
+    {
+        if (disk->ring.sq_ring != MAP_FAILED) munmap(disk->ring.sq_ring, disk->ring.sq_ring_size);
+        if (disk->ring.cq_ring != MAP_FAILED) munmap(disk->ring.cq_ring, disk->ring.cq_ring_size);
+        if (disk->ring.sqes != MAP_FAILED) munmap(disk->ring.sqes, params.sq_entries * sizeof(struct io_uring_sqe));
+        close(disk->ring.ring_fd);
+        disk->ring.ring_fd = -1;
+        return;
+    }
+
+    sq = disk->ring.sq_ring;
+    cq = disk->ring.cq_ring;
+    disk->ring.sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    disk->ring.sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    disk->ring.sq_array = (unsigned*)(sq + params.sq_off.array);
+    disk->ring.cq_head = (unsigned*)(cq + params.cq_off.head);
+    disk->ring.cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    disk->ring.cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    disk->ring.cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+}
+
+/*---------------------------------------------------------------*/
+/*Waits for outstanding requests and tears the rings down         */
+/*---------------------------------------------------------------*/
+static void close_ring(disk_t *disk)
+{
+    if (disk->ring.ring_fd == -1)
+        return;
+
+    while (disk->ring.inflight + disk->ring.nfailed > 0 &&
+           disk_reap(disk, disk->ring.inflight + disk->ring.nfailed) >= 0)
+        ;
+    munmap(disk->ring.sqes, disk->ring.entries * sizeof(struct io_uring_sqe));
+    munmap(disk->ring.sq_ring, disk->ring.sq_ring_size);
+    munmap(disk->ring.cq_ring, disk->ring.cq_ring_size);
+    close(disk->ring.ring_fd);
+    disk->ring.ring_fd = -1;
+}
+
+/*----------------------------------------------------------*/
+/*Close the disk file filled when you don't need it anymore. */
+/*----------------------------------------------------------*/
+int disk_close(disk_t *disk)
+{
+    if (disk == NULL)
+        return 0;
+
+    close_ring(disk);
+    disk_trace_close(disk);
+    while (disk->members > 0)
+    {
+        disk->members--;
+        if(NULL != disk->member_image[disk->members])
+            munmap(disk->member_image[disk->members], (size_t)disk->member_blocks * disk->block_size);
+        close(disk->member_fd[disk->members]);
+    }
+    free(disk->pool.slab);
+    free(disk);
+    return 0;
+}
+
+/*---------------------------------------------------------------*/
+/*Common part of disk_create and disk_open: allocates the handle */
+/*and opens the image files                                      */
+/*---------------------------------------------------------------*/
+static disk_t* setup_disk(char *filename, int block_size, int num_blocks, const disk_config *config, int flags)
+{
+    disk_t *disk = calloc(1, sizeof(disk_t));
+
+    if (disk == NULL)
+        return NULL;
+    if (config == NULL)
+        config = &default_config;
+
+    disk->block_size = block_size;
+    disk->max_block = num_blocks;
+    disk->mode = config->mode;
+    disk->stripe_unit = config->stripe_unit > 0 ? config->stripe_unit : DISK_STRIPE_UNIT;
+    disk->ring.ring_fd = -1;
+
+    /*Set up latency, failure rate and retries of the device*/
+    start_model(disk, &config->model);
+
+    if (open_image(disk, filename, flags) == -1)
+    {
+        disk_close(disk);
+        return NULL;
+    }
+    return disk;
+}
+
+/*------------------------------------------------*/
+/*Initializes a (sparse) disk file filled with 0's*/
+/*------------------------------------------------*/
+disk_t* disk_create(char *filename, int block_size, int num_blocks, const disk_config *config)
+{
+    int i, m;
+    void* zeroBlock;
+    disk_t *disk;
+
+    /*Creates a new file*/
+    disk = setup_disk(filename, block_size, num_blocks, config, O_RDWR | O_CREAT | O_TRUNC);
+    if (disk == NULL)
+    {
+        printf("Could not create new disk file %s\n\n", filename);
+        return NULL;
+    }
+
+    /*Sizes the file without writing it. The image stays sparse, every*/
+    /*block nobody wrote yet reads back as 0's, so formatting only     */
+    /*costs the metadata the file system writes                        */
+    for (m = 0; m < disk->members; m++)
+    {
+        if (ftruncate(disk->member_fd[m], (off_t)disk->member_blocks * block_size) == 0)
+            continue;
+
+        /*Not a regular file (a block device), fill it with 0's instead*/
+        zeroBlock = disk_get_buffer(disk);
+        memset(zeroBlock, 0, block_size);
+        for (i = 0; i < disk->member_blocks; i++)
+        {
+            if (pwrite(disk->member_fd[m], zeroBlock, block_size, (off_t)i * block_size) != block_size)
+            {
+                printf("Could not zero disk file %s\n\n", filename);
+                disk_put_buffer(disk, zeroBlock);
+                disk_close(disk);
+                return NULL;
+            }
+        }
+        disk_put_buffer(disk, zeroBlock);
+    }
+    if (map_image(disk) == -1)
+    {
+        disk_close(disk);
+        return NULL;
+    }
+    setup_ring(disk);
+    return disk;
+}
+/*----------------------------*/
+/*Initializes an existing disk*/
+/*----------------------------*/
+disk_t* disk_open(char *filename, int block_size, int num_blocks, const disk_config *config)
+{
+    disk_t *disk;
+
+    /*Opens a file*/
+    disk = setup_disk(filename, block_size, num_blocks, config, O_RDWR);
+    if (disk == NULL)
+    {
+        printf("Could not open %s\n\n", filename);
+        return NULL;
+    }
+    if (map_image(disk) == -1)
+    {
+        disk_close(disk);
+        return NULL;
+    }
+    setup_ring(disk);
+    return disk;
+}
+
+static int transfer_blocks(disk_t *disk, int write, int start_address, const struct iovec *iov, int iovcnt);
+
+/*-------------------------------------------------------------------*/
+/*Moves a block range through an aligned copy of the caller buffers  */
+/*-------------------------------------------------------------------*/
+static int transfer_bounced(disk_t *disk, int write, int start_address, const struct iovec *iov, int iovcnt, size_t total)
+{
+    struct iovec bounce;
+    char* pos;
+    int i, ret;
+
+    if (posix_memalign(&bounce.iov_base, DISK_ALIGN, total) != 0)
+        return -1;
+    bounce.iov_len = total;
+
+    if (write)
+    {
+        for (i = 0, pos = bounce.iov_base; i < iovcnt; pos += iov[i].iov_len, i++)
+            memcpy(pos, iov[i].iov_base, iov[i].iov_len);
+    }
+    ret = transfer_blocks(disk, write, start_address, &bounce, 1);
+    if (!write && ret >= 0)
+    {
+        for (i = 0, pos = bounce.iov_base; i < iovcnt; pos += iov[i].iov_len, i++)
+            memcpy(iov[i].iov_base, pos, iov[i].iov_len);
+    }
+    free(bounce.iov_base);
+    return ret;
+}
+
+/*-------------------------------------------------------------------*/
+/*Moves bytes between one image file and a set of buffers with       */
+/*positional vectored syscalls. Short transfers are resumed, reads   */
+/*past the end of the file are zero filled                           */
+/*-------------------------------------------------------------------*/
+static int move_range(int write, int fd, off_t offset, struct iovec *cur, int iovcnt)
+{
+    ssize_t done;
+    int i;
+
+    while (iovcnt > 0)
+    {
+        if (write)
+            done = pwritev(fd, cur, iovcnt, offset);
+        else
+            done = preadv(fd, cur, iovcnt, offset);
+
+        if (done < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        /*End of the image file, whatever is left reads back as 0's*/
+        if (done == 0)
+        {
+            if (write)
+                return -1;
+            for (i = 0; i < iovcnt; i++)
+                memset(cur[i].iov_base, 0, cur[i].iov_len);
+            break;
+        }
+
+        /*Skip over the vectors that were completely moved*/
+        offset += done;
+        while (iovcnt > 0 && (size_t)done >= cur->iov_len)
+        {
+            done -= cur->iov_len;
+            cur++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            cur->iov_base = (char*)cur->iov_base + done;
+            cur->iov_len -= done;
+        }
+    }
+    return 0;
+}
+
+/*-------------------------------------------------------------------*/
+/*Cuts the byte range [skip, skip + len) out of a set of buffers     */
+/*-------------------------------------------------------------------*/
+static int slice_iov(const struct iovec *iov, int iovcnt, size_t skip, size_t len, struct iovec *out)
+{
+    int i, n = 0;
+
+    for (i = 0; i < iovcnt && len > 0; i++)
+    {
+        if (skip >= iov[i].iov_len)
+        {
+            skip -= iov[i].iov_len;
+            continue;
+        }
+        out[n].iov_base = (char*)iov[i].iov_base + skip;
+        out[n].iov_len = iov[i].iov_len - skip < len ? iov[i].iov_len - skip : len;
+        len -= out[n].iov_len;
+        skip = 0;
+        n++;
+    }
+    return n;
+}
+
+/*-------------------------------------------------------------------*/
+/*Moves a whole block range. The range is cut at stripe unit         */
+/*boundaries and every piece goes to the member image holding it.    */
+/*Returns the number of blocks moved or -1.                          */
+/*-------------------------------------------------------------------*/
+static int transfer_blocks(disk_t *disk, int write, int start_address, const struct iovec *iov, int iovcnt)
+{
+    struct iovec vec[iovcnt > 0 ? iovcnt : 1];
+    size_t total = 0, skip, len;
+    int block_size = disk->block_size;
+    off_t member_block;
+    int i, n, m, block;
+    char* piece;
+
+    if (disk->members == 0 || iovcnt <= 0 || iovcnt > IOV_MAX)
+        return -1;
+
+    for (i = 0; i < iovcnt; i++)
+        total += iov[i].iov_len;
+
+    /*Only whole blocks can be moved*/
+    if (total % block_size != 0)
+    {
+        printf("partial block transfer of %lu bytes\n", (unsigned long)total);
+        return -1;
+    }
+
+    /*Checks that the data requested is within the range of addresses of the disk*/
+    if (start_address < 0 || start_address + (long)(total / block_size) > disk->max_block)
+    {
+        printf("out of bound error %d\n", start_address);
+        return -1;
+    }
+
+    /*O_DIRECT needs aligned memory, bounce anything else*/
+    if (disk->direct)
+    {
+        for (i = 0; i < iovcnt; i++)
+        {
+            if ((unsigned long)iov[i].iov_base % DISK_ALIGN != 0)
+                return transfer_bounced(disk, write, start_address, iov, iovcnt, total);
+        }
+    }
+
+    for (block = start_address, skip = 0; skip < total; block += len / block_size, skip += len)
+    {
+        len = (size_t)locate(disk, block, &m, &member_block) * block_size;
+        if (len > total - skip)
+            len = total - skip;
+        n = slice_iov(iov, iovcnt, skip, len, vec);
+
+        /*A mapped image is moved with plain memory copies*/
+        if (disk->member_image[m] != NULL)
+        {
+            piece = disk->member_image[m] + (size_t)member_block * block_size;
+            for (i = 0; i < n; i++)
+            {
+                /*Callers may hand back a pointer from disk_block_ptr*/
+                if (piece != vec[i].iov_base)
+                {
+                    if (write)
+                        memcpy(piece, vec[i].iov_base, vec[i].iov_len);
+                    else
+                        memcpy(vec[i].iov_base, piece, vec[i].iov_len);
+                }
+                piece += vec[i].iov_len;
+            }
+        }
+        else if (move_range(write, disk->member_fd[m], member_block * block_size, vec, n) == -1)
+            return -1;
+    }
+
+    return total / block_size;
+}
+
+/*-------------------------------------------------------------------*/
+/*Moves a block range and pauses until the modeled device would be   */
+/*done with it. If every attempt fails nothing is moved and the      */
+/*negative number of failures is returned                            */
+/*-------------------------------------------------------------------*/
+static int timed_transfer(disk_t *disk, int write, int start_address, int nblocks, const struct iovec *iov, int iovcnt)
+{
+    double due, issued = now_us();
+    int e, s;
+
+    if (!disk->timed || start_address < 0 || start_address + nblocks > disk->max_block)
+        s = transfer_blocks(disk, write, start_address, iov, iovcnt);
+    else
+    {
+        due = schedule_request(disk, start_address, nblocks, &e);
+        s = e > disk->model.max_retry ? -e : transfer_blocks(disk, write, start_address, iov, iovcnt);
+
+        /*Pause until the latency duration is elapsed*/
+        wait_until(due);
+    }
+    account(disk, write, start_address, nblocks, s, issued);
+    return s;
+}
+
+/*-------------------------------------------------------------------*/
+/*Runs a request to completion on the calling thread                 */
+/*-------------------------------------------------------------------*/
+static void complete_inline(disk_t *disk, disk_request *req)
+{
+    req->result = timed_transfer(disk, req->op == DISK_WRITE, req->start_address, req->nblocks, &req->iov, 1);
+    req->done = 1;
+}
+
+/*-------------------------------------------------------------------*/
+/*Passes queued submission entries to the kernel, queued is left with*/
+/*the number it did not take                                         */
+/*-------------------------------------------------------------------*/
+static int enter_ring(disk_t *disk, unsigned *queued)
+{
+    int ret;
+
+    while (*queued > 0)
+    {
+        ret = syscall(__NR_io_uring_enter, disk->ring.ring_fd, *queued, 0, 0, NULL, 0);
+        if (ret < 0)
+        {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+                continue;
+            return -1;
+        }
+        disk->ring.inflight += ret;
+        *queued -= ret;
+    }
+    return 0;
+}
+
+/*-------------------------------------------------------------------*/
+/*Fills in the outcome of a request whose pieces all completed       */
+/*-------------------------------------------------------------------*/
+static void finish_request(disk_t *disk, disk_request *req)
+{
+    /*Short transfers (end of image, signals) are finished inline*/
+    if (req->failed)
+        req->result = -1;
+    else if (req->moved == req->iov.iov_len)
+        req->result = req->nblocks;
+    else
+        req->result = transfer_blocks(disk, req->op == DISK_WRITE, req->start_address, &req->iov, 1);
+
+    /*The modeled device may be slower than the real one*/
+    if (disk->timed)
+        wait_until(req->due);
+    account(disk, req->op == DISK_WRITE, req->start_address, req->nblocks, req->result, req->issued);
+    req->done = 1;
+}
+
+/*-------------------------------------------------------------------*/
+/*Completes the failed requests the modeled device has given up on,  */
+/*after sleeping until the first one is due if wait is set. Returns  */
+/*the number completed                                               */
+/*-------------------------------------------------------------------*/
+static int finish_failed(disk_t *disk, int wait)
+{
+    disk_request **prev, *req;
+    double now, first;
+    int n = 0;
+
+    if (wait && disk->ring.failed != NULL)
+    {
+        first = disk->ring.failed->due;
+        for (req = disk->ring.failed->next; req != NULL; req = req->next)
+        {
+            if (req->due < first)
+                first = req->due;
+        }
+        wait_until(first);
+    }
+
+    now = now_us();
+    prev = &disk->ring.failed;
+    while ((req = *prev) != NULL)
+    {
+        if (req->due > now)
+        {
+            prev = &req->next;
+            continue;
+        }
+        *prev = req->next;
+        disk->ring.nfailed--;
+        account(disk, req->op == DISK_WRITE, req->start_address, req->nblocks, req->result, req->issued);
+        req->done = 1;
+        n++;
+    }
+    return n;
+}
+
+/*-------------------------------------------------------------------*/
+/*Backs out of a batch the ring gave up on. Entries not yet passed to*/
+/*the kernel are taken back, the ones it has are waited for, so that */
+/*no buffer is still in use once every unfinished request of the     */
+/*batch is failed                                                    */
+/*-------------------------------------------------------------------*/
+static void abort_submit(disk_t *disk, disk_request *reqs, int nreqs, unsigned queued)
+{
+    int i;
+
+    __atomic_store_n(disk->ring.sq_tail, *disk->ring.sq_tail - queued, __ATOMIC_RELEASE);
+    while (disk->ring.inflight + disk->ring.nfailed > 0 &&
+           disk_reap(disk, disk->ring.inflight + disk->ring.nfailed) >= 0)
+        ;
+    for (i = 0; i < nreqs; i++)
+    {
+        if (!reqs[i].done)
+        {
+            reqs[i].result = -1;
+            reqs[i].done = 1;
+        }
+    }
+}
+
+/*-------------------------------------------------------------------*/
+/*Queues a batch of block requests. They run concurrently and finish */
+/*in any order; each one gets done set (and result filled in with the*/
+/*blocks moved or -1) by disk_reap. A request spanning several       */
+/*stripe units is split into one transfer per unit, all of them in   */
+/*flight together. Buffers must stay untouched until then. Returns   */
+/*the number of requests queued, or -1 with every request of the     */
+/*batch done if the ring fails                                       */
+/*-------------------------------------------------------------------*/
+int disk_submit(disk_t *disk, disk_request *reqs, int nreqs)
+{
+    unsigned tail, idx, queued = 0;
+    struct io_uring_sqe *sqe;
+    disk_request *req;
+    off_t member_block;
+    size_t skip, len;
+    int i, m, block;
+
+    for (i = 0; i < nreqs; i++)
+        reqs[i].done = 0;
+
+    for (i = 0; i < nreqs; i++)
+    {
+        req = &reqs[i];
+        req->result = -1;
+        req->iov.iov_base = req->buffer;
+        req->iov.iov_len = (size_t)req->nblocks * disk->block_size;
+
+        /*Without a ring, for a request that can never succeed, or for*/
+        /*one that needs bouncing, finish right away                  */
+        if (disk->ring.ring_fd == -1 || req->nblocks <= 0 || req->start_address < 0 ||
+            req->start_address + req->nblocks > disk->max_block ||
+            (disk->direct && (unsigned long)req->buffer % DISK_ALIGN != 0))
+        {
+            complete_inline(disk, req);
+            continue;
+        }
+
+        /*Book the request on the modeled device, it completes no sooner*/
+        /*than due. One that would fail all its attempts is not issued, */
+        /*disk_reap fails it once due                                   */
+        req->issued = now_us();
+        req->due = 0;
+        if (disk->timed)
+        {
+            int e;
+            req->due = schedule_request(disk, req->start_address, req->nblocks, &e);
+            if (e > disk->model.max_retry)
+            {
+                req->result = -e;
+                req->next = disk->ring.failed;
+                disk->ring.failed = req;
+                disk->ring.nfailed++;
+                continue;
+            }
+        }
+
+        /*pending holds one extra reference until every piece is queued,*/
+        /*so that pieces reaped while making room cannot finish it early */
+        req->pending = 1;
+        req->moved = 0;
+        req->failed = 0;
+        for (block = req->start_address, skip = 0; skip < req->iov.iov_len; block += len / disk->block_size, skip += len)
+        {
+            len = (size_t)locate(disk, block, &m, &member_block) * disk->block_size;
+            if (len > req->iov.iov_len - skip)
+                len = req->iov.iov_len - skip;
+
+            /*Every queued piece needs a completion slot, make room first*/
+            if (disk->ring.inflight + queued == disk->ring.entries)
+            {
+                if (enter_ring(disk, &queued) < 0 || disk_reap(disk, 1) < 0)
+                {
+                    abort_submit(disk, reqs, nreqs, queued);
+                    return -1;
+                }
+            }
+
+            tail = *disk->ring.sq_tail;
+            idx = tail & *disk->ring.sq_mask;
+            sqe = &disk->ring.sqes[idx];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = req->op == DISK_WRITE ? IORING_OP_WRITE : IORING_OP_READ;
+            sqe->fd = disk->member_fd[m];
+            sqe->off = (unsigned long long)member_block * disk->block_size;
+            sqe->addr = (unsigned long)((char*)req->buffer + skip);
+            sqe->len = len;
+            sqe->user_data = (unsigned long)req;
+            disk->ring.sq_array[idx] = idx;
+            __atomic_store_n(disk->ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+            req->pending++;
+            queued++;
+        }
+        if (--req->pending == 0)
+            finish_request(disk, req);
+    }
+
+    /*Hand everything to the kernel in one go*/
+    if (enter_ring(disk, &queued) < 0)
+    {
+        abort_submit(disk, reqs, nreqs, queued);
+        return -1;
+    }
+
+    return nreqs;
+}
+
+/*-------------------------------------------------------------------*/
+/*Collects finished transfers, and failed requests that are due,     */
+/*waiting until at least min_complete of them are done. Returns the  */
+/*number completed                                                   */
+/*-------------------------------------------------------------------*/
+int disk_reap(disk_t *disk, int min_complete)
+{
+    unsigned head, tail;
+    struct io_uring_cqe *cqe;
+    disk_request *req;
+    int reaped = 0, want;
+
+    if (disk->ring.ring_fd == -1)
+        return 0;
+    if ((unsigned)min_complete > disk->ring.inflight + disk->ring.nfailed)
+        min_complete = disk->ring.inflight + disk->ring.nfailed;
+
+    do
+    {
+        if (disk->ring.failed != NULL)
+            reaped += finish_failed(disk, 0);
+
+        head = *disk->ring.cq_head;
+        tail = __atomic_load_n(disk->ring.cq_tail, __ATOMIC_ACQUIRE);
+
+        /*Nothing ready yet, sleep in the kernel until enough is, or */
+        /*until the first failure is due if nothing else is in flight*/
+        if (head == tail)
+        {
+            if (reaped >= min_complete)
+                break;
+            if (disk->ring.inflight == 0)
+            {
+                reaped += finish_failed(disk, 1);
+                continue;
+            }
+            want = min_complete - reaped;
+            if ((unsigned)want > disk->ring.inflight)
+                want = disk->ring.inflight;
+            if (syscall(__NR_io_uring_enter, disk->ring.ring_fd, 0, want,
+                        IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+                return -1;
+            continue;
+        }
+
+        for (; head != tail; head++)
+        {
+            cqe = &disk->ring.cqes[head & *disk->ring.cq_mask];
+            req = (disk_request*)(unsigned long)cqe->user_data;
+
+            if (cqe->res < 0)
+                req->failed = 1;
+            else
+                req->moved += cqe->res;
+            if (--req->pending == 0)
+                finish_request(disk, req);
+            disk->ring.inflight--;
+            reaped++;
+        }
+        __atomic_store_n(disk->ring.cq_head, head, __ATOMIC_RELEASE);
+    } while (reaped < min_complete);
+
+    return reaped;
+}
+
+/*-------------------------------------------------------------------*/
+/*Waits until every request of a submitted batch is done. Returns 0, */
+/*or -1 if any of them failed or can no longer finish                */
+/*-------------------------------------------------------------------*/
+int disk_wait(disk_t *disk, disk_request *reqs, int nreqs)
+{
+    int i, e = 0;
+
+    for (i = 0; i < nreqs; i++)
+    {
+        while (!reqs[i].done)
+        {
+            /*With nothing in flight the request was never queued*/
+            if (disk->ring.inflight + disk->ring.nfailed == 0 || disk_reap(disk, 1) < 0)
+                return -1;
+        }
+        if (reqs[i].result < 0)
+            e = -1;
+    }
+    return e;
+}
+
+/*-------------------------------------------------------------------*/
+/*Reads a series of blocks from the disk into the buffer             */
+/*-------------------------------------------------------------------*/
+int disk_read(disk_t *disk, int start_address, int nblocks, void *buffer)
+{
+    disk_request req = { DISK_READ, start_address, nblocks, buffer };
+
+    if (disk_submit(disk, &req, 1) < 0 || disk_wait(disk, &req, 1) < 0)
+        return -1;
+    return req.result;
+}
+
+/*------------------------------------------------------------------*/
+/*Writes a series of blocks to the disk from the buffer             */
+/*------------------------------------------------------------------*/
+int disk_write(disk_t *disk, int start_address, int nblocks, void *buffer)
+{
+    disk_request req = { DISK_WRITE, start_address, nblocks, buffer };
+
+    if (disk_submit(disk, &req, 1) < 0 || disk_wait(disk, &req, 1) < 0)
+        return -1;
+    return req.result;
+}
+
+/*------------------------------------------------------------------*/
+/*Scatter/gather on a striped volume: every buffer becomes its own  */
+/*request so that the members are all kept busy at once             */
+/*------------------------------------------------------------------*/
+static int striped_blocksv(disk_t *disk, int op, int start_address, const struct iovec *iov, int iovcnt)
+{
+    disk_request reqs[iovcnt > 0 ? iovcnt : 1];
+    int i, block = start_address;
+
+    if (iovcnt <= 0)
+        return -1;
+    for (i = 0; i < iovcnt; i++)
+    {
+        if (iov[i].iov_len % disk->block_size != 0)
+        {
+            printf("partial block transfer of %lu bytes\n", (unsigned long)iov[i].iov_len);
+            return -1;
+        }
+        reqs[i] = (disk_request) { op, block, iov[i].iov_len / disk->block_size, iov[i].iov_base };
+        block += reqs[i].nblocks;
+    }
+    if (disk_submit(disk, reqs, iovcnt) < 0 || disk_wait(disk, reqs, iovcnt) < 0)
+        return -1;
+    return block - start_address;
+}
+
+/*------------------------------------------------------------------*/
+/*Number of blocks covered by a set of buffers                      */
+/*------------------------------------------------------------------*/
+static int iov_blocks(disk_t *disk, const struct iovec *iov, int iovcnt)
+{
+    size_t total = 0;
+    int i;
+
+    for (i = 0; i < iovcnt; i++)
+        total += iov[i].iov_len;
+    return total / disk->block_size;
+}
+
+/*------------------------------------------------------------------*/
+/*Reads consecutive blocks starting at start_address into a set of  */
+/*buffers (scatter). Every buffer must hold a whole number of blocks*/
+/*------------------------------------------------------------------*/
+int disk_readv(disk_t *disk, int start_address, const struct iovec *iov, int iovcnt)
+{
+    if (disk->members > 1 && disk->ring.ring_fd != -1)
+        return striped_blocksv(disk, DISK_READ, start_address, iov, iovcnt);
+    return timed_transfer(disk, 0, start_address, iov_blocks(disk, iov, iovcnt), iov, iovcnt);
+}
+
+/*------------------------------------------------------------------*/
+/*Writes a set of buffers to consecutive blocks (gather)            */
+/*------------------------------------------------------------------*/
+int disk_writev(disk_t *disk, int start_address, const struct iovec *iov, int iovcnt)
+{
+    if (disk->members > 1 && disk->ring.ring_fd != -1)
+        return striped_blocksv(disk, DISK_WRITE, start_address, iov, iovcnt);
+    return timed_transfer(disk, 1, start_address, iov_blocks(disk, iov, iovcnt), iov, iovcnt);
+}
+
+/*------------------------------------------------------------------*/
+/*Durability barrier. Writes are not flushed individually anymore,  */
+/*everything written so far reaches the device once this returns    */
+/*------------------------------------------------------------------*/
+int disk_sync(disk_t *disk)
+{
+    double issued = now_us();
+    int m;
+
+    if (disk == NULL || disk->members == 0)
+        return -1;
+    /*Writes still in the ring are part of "everything written so far"*/
+    if (disk->ring.inflight > 0 && disk_reap(disk, disk->ring.inflight) < 0)
+        return -1;
+    for (m = 0; m < disk->members; m++)
+    {
+        if (disk->member_image[m] != NULL)
+        {
+            if (msync(disk->member_image[m], (size_t)disk->member_blocks * disk->block_size, MS_SYNC) == -1)
+                return -1;
+        }
+        else if (fdatasync(disk->member_fd[m]) == -1)
+            return -1;
+    }
+    account_sync(disk, 0, disk->max_block, disk->dirty, issued);
+    return 0;
+}
+
+/*------------------------------------------------------------------*/
+/*Durability barrier limited to a block range. With a mapped image  */
+/*only the pages covering those blocks are written back             */
+/*------------------------------------------------------------------*/
+int disk_sync_blocks(disk_t *disk, int start_address, int nblocks)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    double issued = now_us();
+    size_t start, end;
+    off_t member_block;
+    int m, run, block;
+
+    if (start_address < 0 || start_address + nblocks > disk->max_block)
+        return -1;
+    if (disk->member_image[0] == NULL)
+        return disk_sync(disk);
+
+    for (block = start_address; block < start_address + nblocks; block += run)
+    {
+        run = locate(disk, block, &m, &member_block);
+        if (run > start_address + nblocks - block)
+            run = start_address + nblocks - block;
+
+        /*msync wants a page aligned address*/
+        start = (size_t)member_block * disk->block_size;
+        end = start + (size_t)run * disk->block_size;
+        start -= start % page;
+        if (msync(disk->member_image[m] + start, end - start, MS_SYNC) == -1)
+            return -1;
+    }
+    account_sync(disk, start_address, nblocks, (uint64_t)nblocks * disk->block_size, issued);
+    return 0;
+}
+
+/*------------------------------------------------------------------*/
+/*Returns the address of a block inside the mapped image so that it */
+/*can be used in place, or NULL when the image is not mapped. Stores*/
+/*through the pointer reach the disk on the next sync               */
+/*------------------------------------------------------------------*/
+void* disk_block_ptr(disk_t *disk, int address)
+{
+    off_t member_block;
+    int m;
+
+    if (disk->members == 0 || disk->member_image[0] == NULL || address < 0 || address >= disk->max_block)
+        return NULL;
+    locate(disk, address, &m, &member_block);
+    return disk->member_image[m] + (size_t)member_block * disk->block_size;
+}
+
+/*------------------------------------------------------------------*/
+/*Hands out a block sized buffer aligned for DISK_DIRECT transfers. */
+/*Contents are undefined. Give it back with disk_put_buffer         */
+/*------------------------------------------------------------------*/
+void* disk_get_buffer(disk_t *disk)
+{
+    void* buffer;
+
+    if (disk->pool.nfree > 0)
+        return disk->pool.free_list[--disk->pool.nfree];
+
+    /*Pool exhausted, hand out a standalone buffer instead*/
+    if (posix_memalign(&buffer, DISK_ALIGN, disk->block_size) != 0)
+        return NULL;
+    return buffer;
+}
+
+/*------------------------------------------------------------------*/
+/*Returns a buffer obtained from disk_get_buffer                    */
+/*------------------------------------------------------------------*/
+void disk_put_buffer(disk_t *disk, void* buffer)
+{
+    char* block = buffer;
+
+    if (block == NULL)
+        return;
+    if (disk->pool.slab != NULL && block >= disk->pool.slab &&
+        block < disk->pool.slab + (size_t)POOL_BUFFERS * disk->block_size)
+        disk->pool.free_list[disk->pool.nfree++] = block;
+    else
+        free(block);
+}
+
+/*------------------------------------------------------------------*/
+/*Block size of an open disk                                        */
+/*------------------------------------------------------------------*/
+int disk_block_size(disk_t *disk)
+{
+    return disk->block_size;
+}
+
+/*------------------------------------------------------------------*/
+/*Copies the counters of a disk                                     */
+/*------------------------------------------------------------------*/
+void disk_get_stats(disk_t *disk, disk_stats *stats)
+{
+    *stats = disk->stats;
+}
+
+/*------------------------------------------------------------------*/
+/*Starts counting from zero, e.g. before the operation to measure   */
+/*------------------------------------------------------------------*/
+void disk_reset_stats(disk_t *disk)
+{
+    memset(&disk->stats, 0, sizeof(disk->stats));
+}
+
+/*------------------------------------------------------------------*/
+/*Prints the counters and the non empty latency buckets             */
+/*------------------------------------------------------------------*/
+void disk_print_stats(disk_t *disk)
+{
+    disk_stats *st = &disk->stats;
+    uint64_t total = st->sequential + st->random;
+    int i;
+
+    printf("reads %llu (%llu blocks), writes %llu (%llu blocks), errors %llu\n",
+           (unsigned long long)st->reads, (unsigned long long)st->blocks_read,
+           (unsigned long long)st->writes, (unsigned long long)st->blocks_written,
+           (unsigned long long)st->errors);
+    printf("sequential %llu, random %llu (%.1f%% sequential)\n",
+           (unsigned long long)st->sequential, (unsigned long long)st->random,
+           total > 0 ? 100.0 * st->sequential / total : 0.0);
+    printf("syncs %llu, bytes flushed %llu\n",
+           (unsigned long long)st->syncs, (unsigned long long)st->bytes_flushed);
+    for (i = 0; i < DISK_LAT_BUCKETS; i++)
+    {
+        if (st->latency[i] > 0)
+            printf("  < %10lluus %llu\n", 1ULL << i, (unsigned long long)st->latency[i]);
+    }
+}
+
+/*------------------------------------------------------------------*/
+/*Starts recording every request of the disk to a binary file of    */
+/*disk_trace_record entries. A trace that is already open is closed */
+/*------------------------------------------------------------------*/
+int disk_trace_open(disk_t *disk, const char *path)
+{
+    disk_trace_close(disk);
+    disk->trace = fopen(path, "wb");
+    if (disk->trace == NULL)
+    {
+        printf("Could not open trace file %s\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+/*------------------------------------------------------------------*/
+/*Stops recording and writes out what is buffered                   */
+/*------------------------------------------------------------------*/
+int disk_trace_close(disk_t *disk)
+{
+    int ret = 0;
+
+    if (disk->trace != NULL)
+    {
+        ret = fclose(disk->trace);
+        disk->trace = NULL;
+    }
+    return ret;
+}
+
+/*------------------------------------------------------------------*/
+/*Prints a trace file as text, one request per line                 */
+/*------------------------------------------------------------------*/
+int disk_trace_dump(const char *path)
+{
+    static const char* ops[] = { "R", "W", "S" };
+    disk_trace_record rec;
+    FILE* f = fopen(path, "rb");
+
+    if (f == NULL)
+    {
+        printf("Could not open trace file %s\n", path);
+        return -1;
+    }
+    printf("%-16s %2s %10s %8s %8s %10s\n", "time_us", "op", "start", "blocks", "result", "latency_us");
+    while (fread(&rec, sizeof(rec), 1, f) == 1)
+    {
+        printf("%-16llu %2s %10d %8d %8d %10u\n", (unsigned long long)rec.timestamp_us,
+               rec.op <= DISK_TRACE_SYNC ? ops[rec.op] : "?", rec.start_address, rec.nblocks,
+               rec.result, rec.latency_us);
+    }
+    fclose(f);
+    return 0;
+}
+
+/*******************************************************************/
+/* Single disk API, kept for programs written against one global   */
+/* disk. Everything goes to the disk opened by the last            */
+/* init_fresh_disk/init_disk call                                  */
+/*******************************************************************/
+
+/*---------------------------------------------------------------*/
+/*Selects how the image is accessed (DISK_PIO, DISK_MMAP or      */
+/*DISK_DIRECT). Takes effect on the next init_fresh_disk/init_disk*/
+/*---------------------------------------------------------------*/
+void set_disk_mode(int disk_mode)
+{
+    default_config.mode = disk_mode;
+}
+
+/*---------------------------------------------------------------*/
+/*Selects the timing and failure model of the device. Takes      */
+/*effect on the next init_fresh_disk/init_disk call              */
+/*---------------------------------------------------------------*/
+void set_disk_model(const disk_model *disk_model)
+{
+    default_config.model = *disk_model;
+}
+
+/*---------------------------------------------------------------*/
+/*Sets how many consecutive blocks go to one image before moving */
+/*on to the next one when the disk file name lists several images*/
+/*Takes effect on the next init_fresh_disk/init_disk call        */
+/*---------------------------------------------------------------*/
+void set_stripe_unit(int nblocks)
+{
+    if (nblocks > 0)
+        default_config.stripe_unit = nblocks;
+}
+
+int init_fresh_disk(char *filename, int block_size, int num_blocks)
+{
+    close_disk();
+    default_disk = disk_create(filename, block_size, num_blocks, &default_config);
+    return default_disk == NULL ? -1 : 0;
+}
+
+int init_disk(char *filename, int block_size, int num_blocks)
+{
+    close_disk();
+    default_disk = disk_open(filename, block_size, num_blocks, &default_config);
+    return default_disk == NULL ? -1 : 0;
+}
+
+int close_disk()
+{
+    disk_close(default_disk);
+    default_disk = NULL;
+    return 0;
+}
+
+int read_blocks(int start_address, int nblocks, void *buffer)
+{
+    return default_disk == NULL ? -1 : disk_read(default_disk, start_address, nblocks, buffer);
+}
+
+int write_blocks(int start_address, int nblocks, void *buffer)
+{
+    return default_disk == NULL ? -1 : disk_write(default_disk, start_address, nblocks, buffer);
+}
+
+int read_blocksv(int start_address, const struct iovec *iov, int iovcnt)
+{
+    return default_disk == NULL ? -1 : disk_readv(default_disk, start_address, iov, iovcnt);
+}
+
+int write_blocksv(int start_address, const struct iovec *iov, int iovcnt)
+{
+    return default_disk == NULL ? -1 : disk_writev(default_disk, start_address, iov, iovcnt);
+}
+
+int submit_blocks(disk_request *reqs, int nreqs)
+{
+    return default_disk == NULL ? -1 : disk_submit(default_disk, reqs, nreqs);
+}
+
+int reap_blocks(int min_complete)
+{
+    return default_disk == NULL ? -1 : disk_reap(default_disk, min_complete);
+}
+
+int wait_blocks(disk_request *reqs, int nreqs)
+{
+    return default_disk == NULL ? -1 : disk_wait(default_disk, reqs, nreqs);
+}
+
+int sync_disk()
+{
+    return disk_sync(default_disk);
+}
+
+int sync_blocks(int start_address, int nblocks)
+{
+    return default_disk == NULL ? -1 : disk_sync_blocks(default_disk, start_address, nblocks);
+}
+
+void* get_block_ptr(int address)
+{
+    return default_disk == NULL ? NULL : disk_block_ptr(default_disk, address);
+}
+
+void* get_block_buffer()
+{
+    return default_disk == NULL ? NULL : disk_get_buffer(default_disk);
+}
+
+void put_block_buffer(void* buffer)
+{
+    if (default_disk != NULL)
+        disk_put_buffer(default_disk, buffer);
+    else
+        free(buffer);
+}
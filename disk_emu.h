@@ -1,5 +1,150 @@
+#ifndef _INCLUDE_DISK_EMU_H_
+#define _INCLUDE_DISK_EMU_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+// Ways of accessing the image, see disk_config
+#define DISK_PIO  0
+#define DISK_MMAP 1
+#define DISK_DIRECT 2
+
+// Memory alignment of buffers from disk_get_buffer()
+#define DISK_ALIGN 4096
+
+// Striping across several image files, see disk_open()
+#define DISK_MAX_MEMBERS 16
+#define DISK_STRIPE_UNIT 16
+
+// Asynchronous block requests, see disk_submit()
+#define DISK_READ  0
+#define DISK_WRITE 1
+#define DISK_QUEUE_DEPTH 32
+
+// An open volume (one image file or several striped ones)
+typedef struct disk disk_t;
+
+typedef struct disk_request {
+    int op;
+    int start_address;
+    int nblocks;
+    void *buffer;
+    int result;     // blocks moved or -1, valid once done is set
+    int done;
+    // private to disk_emu
+    struct iovec iov;
+    double issued;
+    double due;
+    int pending;
+    size_t moved;
+    int failed;
+    struct disk_request *next;
+} disk_request;
+
+// Timing and failure model of the emulated device
+typedef struct {
+    double overhead_us;        // fixed cost of every request
+    double seek_us;            // cost of a request not starting where the previous one ended
+    double seek_us_per_block;  // plus this much per block of distance
+    double max_seek_us;        // cap on the seek cost, 0 for none
+    double bandwidth;          // transfer rate in MB/s, 0 for unlimited
+    int queue_depth;           // requests serviced at the same time
+    double failure_p;          // probability that an attempt fails
+    int max_retry;             // retries before a request gives up
+    unsigned int seed;         // seed of the failure draws, 0 to take one from the clock
+} disk_model;
+
+extern const disk_model DISK_MODEL_NONE;
+extern const disk_model DISK_MODEL_HDD;
+extern const disk_model DISK_MODEL_SSD;
+
+// How a disk is opened
+//   mode         DISK_PIO, DISK_MMAP or DISK_DIRECT
+//   stripe_unit  blocks per image before moving on to the next one when
+//                the file name lists several images separated by ':'
+//   model        device timing, DISK_MODEL_NONE for none
+typedef struct {
+    int mode;
+    int stripe_unit;
+    disk_model model;
+} disk_config;
+
+// Latency histogram of disk_stats, bucket i counts requests that took
+// between 2^(i-1) and 2^i microseconds (bucket 0 is under 1us)
+#define DISK_LAT_BUCKETS 32
+
+// Counters kept by every disk, see disk_get_stats()
+typedef struct {
+    uint64_t reads;            // read requests completed
+    uint64_t writes;           // write requests completed
+    uint64_t blocks_read;
+    uint64_t blocks_written;
+    uint64_t sequential;       // requests starting where the previous one ended
+    uint64_t random;           // all the others
+    uint64_t errors;           // requests that failed
+    uint64_t syncs;            // durability barriers
+    uint64_t bytes_flushed;    // written bytes made durable by those barriers
+    uint64_t latency[DISK_LAT_BUCKETS];
+} disk_stats;
+
+// One record of the binary trace, see disk_trace_open(). Records are
+// written back to back in host byte order
+typedef struct {
+    uint64_t timestamp_us;     // when the request was issued, monotonic clock
+    uint32_t latency_us;       // until it completed
+    int32_t start_address;
+    int32_t nblocks;
+    int32_t result;            // blocks moved, negative on failure
+    uint8_t op;                // DISK_READ, DISK_WRITE or DISK_TRACE_SYNC
+    uint8_t pad[7];
+} disk_trace_record;
+
+#define DISK_TRACE_SYNC 2
+
+// Handle based API, any number of disks can be open at once
+disk_t* disk_create(char *filename, int block_size, int num_blocks, const disk_config *config);
+disk_t* disk_open(char *filename, int block_size, int num_blocks, const disk_config *config);
+int disk_close(disk_t *disk);
+int disk_read(disk_t *disk, int start_address, int nblocks, void *buffer);
+int disk_write(disk_t *disk, int start_address, int nblocks, void *buffer);
+int disk_readv(disk_t *disk, int start_address, const struct iovec *iov, int iovcnt);
+int disk_writev(disk_t *disk, int start_address, const struct iovec *iov, int iovcnt);
+int disk_submit(disk_t *disk, disk_request *reqs, int nreqs);
+int disk_reap(disk_t *disk, int min_complete);
+int disk_wait(disk_t *disk, disk_request *reqs, int nreqs);
+int disk_sync(disk_t *disk);
+int disk_sync_blocks(disk_t *disk, int start_address, int nblocks);
+void* disk_block_ptr(disk_t *disk, int address);
+void* disk_get_buffer(disk_t *disk);
+void disk_put_buffer(disk_t *disk, void* buffer);
+int disk_block_size(disk_t *disk);
+void disk_get_stats(disk_t *disk, disk_stats *stats);
+void disk_reset_stats(disk_t *disk);
+void disk_print_stats(disk_t *disk);
+int disk_trace_open(disk_t *disk, const char *path);
+int disk_trace_close(disk_t *disk);
+int disk_trace_dump(const char *path);
+
+// Single disk API, works on the disk opened by the last init_*disk call
+void set_disk_mode(int disk_mode);
+void set_disk_model(const disk_model *disk_model);
+void set_stripe_unit(int nblocks);
+
 int init_fresh_disk(char *filename, int block_size, int num_blocks);
 int init_disk(char *filename, int block_size, int num_blocks);
 int read_blocks(int start_address, int nblocks, void *buffer);
 int write_blocks(int start_address, int nblocks, void *buffer);
+int read_blocksv(int start_address, const struct iovec *iov, int iovcnt);
+int write_blocksv(int start_address, const struct iovec *iov, int iovcnt);
+int submit_blocks(disk_request *reqs, int nreqs);
+int reap_blocks(int min_complete);
+int wait_blocks(disk_request *reqs, int nreqs);
+int sync_disk();
+int sync_blocks(int start_address, int nblocks);
+void* get_block_ptr(int address);
+void* get_block_buffer();
+void put_block_buffer(void* buffer);
 int close_disk();
+
+#endif //_INCLUDE_DISK_EMU_H_
@@ -3,6 +3,8 @@
 #include <fuse.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -145,6 +147,39 @@ static int fuse_truncate(const char *path, off_t size)
     return 0;
 }
 
+static int fuse_fallocate(const char *path, int mode, off_t offset, off_t length,
+        struct fuse_file_info *fi)
+{
+    int fd;
+    int res;
+    
+    char filename[MAXFILENAME];
+    
+    // Only plain preallocation, which grows the file to cover the range
+    if (mode != 0)
+        return -EOPNOTSUPP;
+    
+    // The range must be a real one, and end where the int sizes of the
+    // sfs API can still reach
+    if (offset < 0 || length <= 0 || (uintmax_t)offset + (uintmax_t)length > INTMAX_MAX)
+        return -EINVAL;
+    if (offset + length > INT_MAX)
+        return -EFBIG;
+    
+    strcpy(filename, path);
+    
+    fd = sfs_fopen(filename);
+    if (fd == -1)
+        return -errno;
+    
+    res = sfs_fallocate(fd, offset, length);
+    sfs_fclose(fd);
+    if (res == -1)
+        return -ENOSPC;
+    
+    return 0;
+}
+
 static int fuse_access(const char *path, int mask)
 {
     return 0;
@@ -167,6 +202,18 @@ static int fuse_create (const char *path, mode_t mode, struct fuse_file_info *fp
     return 0;
 }
 
+static int fuse_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    if (sfs_syncfs() == -1)
+        return -EIO;
+    return 0;
+}
+
+static void fuse_destroy(void *private_data)
+{
+    sfs_syncfs();
+}
+
 static struct fuse_operations xmp_oper = {
     .getattr = fuse_getattr,
     .readdir = fuse_readdir,
@@ -176,8 +223,11 @@ static struct fuse_operations xmp_oper = {
     .open = fuse_open, 
     .read = fuse_read, 
     .write = fuse_write, 
+    .fallocate = fuse_fallocate,
     .access = fuse_access,
     .create = fuse_create,
+    .fsync = fuse_fsync,
+    .destroy = fuse_destroy,
 };
 
 int main(int argc, char *argv[])
@@ -1,12 +1,19 @@
 // NOTES
 // Simple File system has the following structure
-//    Super Block - I Node Table - Data blocks - Free Bitmap
+//    Super Block - Block Group 0 - Block Group 1 - ...
+//    Block Group: Free Bitmap - I Node Table slice - Data blocks
+//        The first one also holds the root directory after its i-nodes
+//        (a directory too large for it goes on after the i-nodes of the next groups)
 //    Super Block (fields of 4 bytes each)
-//        Magic (0xACBD0005)
-//        Block Size (typically 1024)
+//        Magic (0xACBD0009, 0xACBD0008 had a fixed geometry)
+//        Block Size (512 to 65536, typically 1024)
 //        File System Size (in blocks)
 //        I-node table length (in blocks)
 //        Root directory (i-Node number)
+//        Blocks per group
+//        I-node count
+//            All of the layout follows from these, so they are read
+//            first on mount and size every table in memory
 //            Root directory is pointed to by an i-Node which is pointed to by super block
 //            Directory is a mapping table to convert file name to i-Node
 //            Contains at least i-Node and file name
@@ -27,10 +34,10 @@
 //            UID: User id
 //            GID: Group id
 //            Size: size in bytes
-//            Pointer 1
-//            ...
-//            Pointer 12
-//            Indirect Pointer (only single)
+//            Extents (logical block, physical block, length)
+//                Four in the inode, more in a tree of blocks below it
+//            Inline data: a file of up to INODE_INLINE bytes is kept in
+//                the inode instead, until it grows past that
 //    In Memory data structures
 //        Directory table
 //            Keeps a copy of the directory block in memory
@@ -70,122 +77,1146 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 
 #include "disk_emu.h"
+#include "block_cache.h"
 
 int seen = 0;
 
+// Several images separated by ':' stripe the volume across all of them,
+// JITS_STRIPE_UNIT blocks at a time
 #define JITS_DISK "sfs_disk.disk"
-#define BLOCK_SIZE 1024
-#define NUM_BLOCKS 100  //TODO: increase
-#define NUM_INODES 10   //TODO: increase
-#define FREE_MAP_SIZE ((NUM_BLOCKS+8-1) / 8)
-#define FREE_MAP_BLOCKS ((FREE_MAP_SIZE + BLOCK_SIZE - 1) / BLOCK_SIZE)
-#define NUM_INODE_BLOCKS (sizeof(inode_t) * NUM_INODES / BLOCK_SIZE + 1) 
-// TODO figure this out
-#define NUM_ROOTDIR_BLOCKS 1
-#define PTR_SIZE (sizeof(int))
+#define JITS_STRIPE_UNIT DISK_STRIPE_UNIT
+// DISK_PIO goes through pread/pwrite, DISK_MMAP maps the image so that
+// blocks are used in place instead of being cached (see cache_get),
+// DISK_DIRECT bypasses the page cache
+#define JITS_DISK_MODE DISK_PIO
+// Timing of the emulated device: DISK_MODEL_NONE, DISK_MODEL_HDD or DISK_MODEL_SSD
+#define JITS_DISK_MODEL DISK_MODEL_NONE
+// Blocks kept by the write-back cache, see block_cache.c
+#define JITS_CACHE_BLOCKS 64
+// 1 keeps appended blocks in the file descriptor and allocates them only
+// when the file is flushed, see DELAYED ALLOCATION (make test-delalloc)
+#ifndef JITS_DELAYED_ALLOC
+#define JITS_DELAYED_ALLOC 0
+#endif
+// 1 keeps new files in their inode until they outgrow INODE_INLINE bytes,
+// see INLINE DATA
+#define JITS_INLINE_DATA 1
+// Geometry of the volume mksfs() formats, sfs_format() takes any other
+// (see sfs_geometry). A volume that is mounted again keeps the geometry
+// its superblock records
+#define JITS_BLOCK_SIZE 1024
+#define JITS_NUM_BLOCKS 100
+#define JITS_NUM_INODES 10
+// The volume is cut into block groups of group_blocks blocks. A group
+// starts with its own block of the free bitmap and its own slice of the
+// inode table, and its data blocks follow, so the blocks of a file sit
+// next to its inode. Group 0 has the superblock in front of its bitmap and
+// the root directory after its inodes. group_blocks is a multiple of 64,
+// at most 8 * block_size so that the bitmap of a group fits in one block
+#define JITS_GROUP_BLOCKS 64
+// 0xACBD0008 recorded neither the block count nor the inode count
+#define SFS_MAGIC ((int)0xACBD0009)
+#define MIN_BLOCK_SIZE 512
+#define MAX_BLOCK_SIZE 65536
+#define GROUP_INODE_SIZE(_fs) ((size_t)(_fs)->group_inodes * sizeof(inode_t))
+#define GROUP_MAP(_fs, _g) ((_g) * (_fs)->group_blocks + ((_g) == 0))
+#define GROUP_INODE_START(_fs, _g) (GROUP_MAP(_fs, _g) + 1)
+#define INODE_GROUP(_fs, _inode) ((_inode) / (_fs)->group_inodes)
+// The free bitmap is kept as 64 bit words (bit b of word w is block 64w+b,
+// set when free), which on disk is the same as the old byte layout
+// One summary bit per bitmap word, set when the word has a free block
+#define FREE_SUMMARY_WORDS(_fs) (((_fs)->map_words+64-1) / 64)
+// Read ahead window of a sequentially read file, in blocks. It starts
+// small and doubles while the reads stay sequential
+#define READAHEAD_MIN 4
+#define READAHEAD_MAX (JITS_CACHE_BLOCKS/4)
+// Reservation window of a growing file, in blocks. It doubles each time
+// the file uses it up
+#define RESERVE_MIN 8
+#define RESERVE_MAX 128
+// Appended blocks an open file holds back with JITS_DELAYED_ALLOC
+#define DELAYED_BLOCKS 32
 /* macros */
 #define FREE_BIT(_data, _which_bit) \
-    _data = _data | (1 << _which_bit)
+    _data = _data | ((uint64_t)1 << _which_bit)
 
 #define USE_BIT(_data, _which_bit) \
-    _data = _data & ~(1 << _which_bit)
-
-
-superblock_t sb;
-uint8_t free_bit_map[FREE_MAP_SIZE] = { [0 ... FREE_MAP_SIZE-1] = UINT8_MAX };
-inode_t inode_table[NUM_INODES];
-file_descriptor fd_table[NUM_INODES];
-file_map root_directory[NUM_INODES]; 
+    _data = _data & ~((uint64_t)1 << _which_bit)
+
+
+// Free blocks set aside for a growing file, [next, end) are still unused
+// slot is where the file is in resv_list plus one, 0 while it is not there
+typedef struct {
+  int next;
+  int end;
+  int size;
+  int slot;
+} reservation;
+
+// Allocation state of one block group, nothing in it is shared with the
+// other groups
+typedef struct {
+  int free_blocks;
+  // Where the next search in the group starts
+  int hint;
+  // Same for the inodes of the group
+  int free_inodes;
+  int inode_hint;
+} block_group;
+
+// Blocks of a metadata table changed since they were last copied to the
+// cache. Only the flags from lo up to hi are looked at when writing them
+typedef struct {
+  uint8_t* flags;
+  int lo;
+  int hi;
+} dirty_set;
+
+// Everything belonging to one mounted volume
+// Nothing is shared between two of these, so several volumes can be
+// mounted at once and each can be used from its own thread
+struct sfs {
+  disk_t* disk;
+  // Every block goes through the cache, it reaches the disk on eviction or sfs_sync()
+  block_cache_t* cache;
+  superblock_t sb;
+  // Geometry, from the superblock (see set_geometry), the tables below
+  // are sized from it
+  int block_size;
+  int num_blocks;
+  int num_inodes;
+  int group_blocks;
+  int num_groups;
+  int group_inodes;
+  int group_inode_blocks;
+  int rootdir_blocks;
+  int map_words;
+  uint64_t* free_bit_map;
+  uint64_t* free_summary;
+  block_group* groups;
+  int free_blocks;
+  reservation* resv;
+  // Inodes with a reservation window, resv_count of them
+  int* resv_list;
+  int resv_count;
+  // Blocks held back by all descriptors, see DELAYED ALLOCATION
+  int delayed_blocks;
+  // Inode i is in the slice of group INODE_GROUP(fs, i), the slices follow
+  // each other in memory
+  inode_t* inode_table;
+  file_descriptor* fd_table;
+  file_map* root_directory;
+  // Where each block of the root directory is, see place_root_directory
+  int* dir_blocks;
+  // Inode numbers by hash of the file name, see NAME INDEX
+  int* name_index;
+  int name_slots;
+  // Table blocks changed since they were last copied to the cache
+  dirty_set map_dirty;
+  dirty_set inode_dirty;
+  dirty_set dir_dirty;
+  // Index for iterating over files in sfs_next_filename()
+  int nextFilenameIdx;
+};
 
 
 // Flag for debugging printing
 int DEBUG = 1;
-// Index for iterating over files in sfs_getnextfilename()
-int nextFilenameIdx = 0;
 
+// The volume used by mksfs() and the sfs_f* calls
+sfs_t* default_fs = NULL;
 
-//////////////////// MARK NEXT FREE BLOCK ////////////////////
-// From tutorial code
-int get_next_free_block() {
-    int i = 0;
-
-    // find the first section with a free bit
-    // let's ignore overflow for now...
-    while (free_bit_map[i] == 0) { i++; }
-    // now, find the first free bit
-    // ffs has the lsb as 1, not 0. So we need to subtract
-    uint8_t bit = ffs(free_bit_map[i]) - 1;
-
-    // The map is full (want to allocate fewer than number of blocks)
-    // Have to keep in mind the map size at the end though, don't want to overwrite
-    if (i*8 + bit >= NUM_BLOCKS - FREE_MAP_BLOCKS){
-      if (DEBUG==1) printf("Unable to allocate a block \n");
-      return -1;
+
+//////////////////// DIRTY SETS ////////////////////
+// Flags block i of a table
+void set_dirty(dirty_set *d, int i) {
+  if (d->lo >= d->hi) d->lo = d->hi = i;
+  if (i < d->lo) d->lo = i;
+  if (i >= d->hi) d->hi = i + 1;
+  d->flags[i] = 1;
+}
+
+// Takes the flag off the first flagged block and returns it, -1 if none is left
+int next_dirty(dirty_set *d) {
+  while (d->lo < d->hi){
+    int i = d->lo++;
+    if (d->flags[i]){
+      d->flags[i] = 0;
+      return i;
+    }
+  }
+  return -1;
+}
+
+
+//////////////////// WRITE FREE BITMAP ////////////////////
+// Allocating and freeing only flag the group holding the bit
+// The flagged bitmap blocks are copied to the cache once per operation (write_metadata)
+void write_free_map(sfs_t *fs) {
+    int g;
+    while ((g = next_dirty(&fs->map_dirty)) != -1){
+      char* mapBlock = cache_get(fs->cache, GROUP_MAP(fs, g), CACHE_NOREAD);
+      if (mapBlock == NULL){
+        set_dirty(&fs->map_dirty, g);
+        return;
+      }
+      memset(mapBlock, 0, fs->block_size);
+      memcpy(mapBlock, (char*)fs->free_bit_map + (size_t)g*fs->group_blocks/8, fs->group_blocks/8);
+
+      // Reserved blocks are only used in memory, on disk they stay free
+      for (int n = 0; n < fs->resv_count; n++){
+        reservation* r = &fs->resv[fs->resv_list[n]];
+        for (int b = r->next; b < r->end; b++){
+          if (b / fs->group_blocks == g) mapBlock[b % fs->group_blocks / 8] |= 1 << (b % 8);
+        }
+      }
+      cache_put(fs->cache, GROUP_MAP(fs, g), 1);
     }
+}
 
-    if (DEBUG==1) printf("Grabbing block at char %d bit %d \n", i, bit);
+
+//////////////////// FREE BITMAP SUMMARY ////////////////////
+// Rebuilds the summary and the group counters from the bitmap, after it
+// was loaded or created. Blocks past the end of the volume are marked used first
+void init_free_summary(sfs_t *fs) {
+    for (int i = fs->num_blocks; i < fs->map_words * 64; i++) USE_BIT(fs->free_bit_map[i / 64], i % 64);
+    memset(fs->free_summary, 0, FREE_SUMMARY_WORDS(fs) * sizeof(uint64_t));
+    fs->free_blocks = 0;
+    for (int g = 0; g < fs->num_groups; g++){
+      fs->groups[g].free_blocks = 0;
+      fs->groups[g].hint = g * fs->group_blocks;
+    }
+    for (int w = 0; w < fs->map_words; w++){
+      if (fs->free_bit_map[w] != 0) FREE_BIT(fs->free_summary[w / 64], w % 64);
+      fs->groups[w * 64 / fs->group_blocks].free_blocks += __builtin_popcountll(fs->free_bit_map[w]);
+      fs->free_blocks += __builtin_popcountll(fs->free_bit_map[w]);
+    }
+}
+
+// Marks block index used, keeping the summary in step
+void use_block(sfs_t *fs, int index) {
+    int w = index / 64;
+    USE_BIT(fs->free_bit_map[w], index % 64);
+    fs->free_blocks--;
+    fs->groups[index / fs->group_blocks].free_blocks--;
+    if (fs->free_bit_map[w] == 0) USE_BIT(fs->free_summary[w / 64], w % 64);
+
+    // The bitmap block is written at the end of the operation
+    set_dirty(&fs->map_dirty, index / fs->group_blocks);
+}
+
+// First word in [from, end) holding a free block, or -1. The summary
+// says which words are worth looking at, 64 words per summary word
+int find_free_word(sfs_t *fs, int from, int end) {
+    while (from < end){
+      uint64_t summary = fs->free_summary[from / 64] & (~(uint64_t)0 << (from % 64));
+      if (summary != 0){
+        int word = from / 64 * 64 + __builtin_ctzll(summary);
+        return word < end ? word : -1;
+      }
+      from = (from / 64 + 1) * 64;
+    }
+    return -1;
+}
+
+
+//////////////////// MARK FREE BLOCK IN GROUP ////////////////////
+// Next fit inside group g: the search starts at block from and wraps around
+// to the start of the group. Returns -1 if the group is full
+int alloc_in_group(sfs_t *fs, int g, int from) {
+    int first = g * fs->group_blocks;
+    int end = first + fs->group_blocks;
+    if (fs->groups[g].free_blocks == 0) return -1;
+    if (from < first || from >= end) from = first;
+
+    int w = from / 64;
+    int index = -1;
+    uint64_t bits = fs->free_bit_map[w] & (~(uint64_t)0 << (from % 64));
+    if (bits != 0) index = w*64 + __builtin_ctzll(bits);
+    else {
+      int word = find_free_word(fs, w + 1, end / 64);
+      if (word == -1) word = find_free_word(fs, first / 64, w + 1);
+      if (word == -1) return -1;
+      index = word*64 + __builtin_ctzll(fs->free_bit_map[word]);
+    }
+
+    if (DEBUG==1) printf("Grabbing block %d in group %d \n", index, g);
 
     // set the bit to used
-    USE_BIT(free_bit_map[i], bit);
+    use_block(fs, index);
+    fs->groups[g].hint = index + 1;
+    return index;
+}
+
+
+//////////////////// MARK NEXT FREE BLOCK ////////////////////
+// Next fit in group g, then in the groups after it
+int get_next_free_block(sfs_t *fs, int g) {
+    for (int n = 0; n < fs->num_groups; n++){
+      int group = (g + n) % fs->num_groups;
+      int index = alloc_in_group(fs, group, fs->groups[group].hint);
+      if (index != -1) return index;
+    }
+
+    // The map is full
+    if (DEBUG==1) printf("Unable to allocate a block \n");
+    return -1;
+}
+
+
+//////////////////// MARK FREE BLOCK NEAR ////////////////////
+// Takes block goal if it is free, so that a growing file stays contiguous
+// Otherwise the next free block after it in its group, then anywhere
+int get_free_block_near(sfs_t *fs, int goal) {
+    if (goal <= 0 || goal >= fs->num_blocks) goal = 0;
+    if (goal > 0 && (fs->free_bit_map[goal / 64] & ((uint64_t)1 << (goal % 64)))){
+      use_block(fs, goal);
+      return goal;
+    }
+    int index = alloc_in_group(fs, goal / fs->group_blocks, goal);
+    if (index != -1) return index;
+    return get_next_free_block(fs, goal / fs->group_blocks);
+}
+
+
+//////////////////// MARK FREE RUN ////////////////////
+// Looks for want free blocks in a row from goal to the end of the volume,
+// then from its start, in one pass over the bitmap. The first run long
+// enough is taken, else the longest one seen. Marks it used and returns its
+// first block, its length in got, or -1 if the volume is full
+int get_free_run(sfs_t *fs, int goal, int want, int *got) {
+    if (goal <= 0 || goal >= fs->num_blocks) goal = 0;
+    int bestStart = -1, bestLen = 0;
+    int start = 0, len = 0;
+
+    for (int n = 0; n < fs->num_blocks && bestLen < want; n++){
+      int b = (goal + n) % fs->num_blocks;
+      // A run does not wrap around the end of the volume
+      if (b == 0) len = 0;
+
+      // Words without a free block are skipped whole
+      if (b % 64 == 0 && fs->free_bit_map[b / 64] == 0){
+        len = 0;
+        n += (b + 64 <= fs->num_blocks ? 64 : fs->num_blocks - b) - 1;
+        continue;
+      }
+
+      if (fs->free_bit_map[b / 64] & ((uint64_t)1 << (b % 64))){
+        if (len == 0) start = b;
+        len++;
+        if (len > bestLen){
+          bestStart = start;
+          bestLen = len;
+        }
+      }
+      else len = 0;
+    }
+
+    if (bestStart == -1){
+      if (DEBUG==1) printf("Unable to allocate a block \n");
+      return -1;
+    }
+    if (DEBUG==1) printf("Grabbing %d blocks from block %d \n", bestLen, bestStart);
 
-    // Write the new table back to memory
-    char* tempBlock = calloc(BLOCK_SIZE,1);
-    memcpy(tempBlock, free_bit_map, sizeof(free_bit_map));
-    write_blocks(NUM_BLOCKS-FREE_MAP_BLOCKS, FREE_MAP_BLOCKS, tempBlock);
-    free(tempBlock);
-    //return which bit we used
-    return i*8 + bit;
+    for (int b = bestStart; b < bestStart + bestLen; b++) use_block(fs, b);
+    fs->groups[bestStart / fs->group_blocks].hint = bestStart + bestLen;
+    *got = bestLen;
+    return bestStart;
 }
 
 
 //////////////////// UNMARK NEXT FREE BLOCK ////////////////////
 // From tutorial code
-void free_block_at(int index) {
+void free_block_at(sfs_t *fs, int index) {
+
+    // Block 0 is the superblock, a 0 pointer means no block at all
+    if (index <= 0 || index >= fs->num_blocks) return;
+
+    // get index in array of which word to free
+    int w = index / 64;
+    if (fs->free_bit_map[w] & ((uint64_t)1 << (index % 64))) return;
+
+    // free bit, the word has a free block now
+    FREE_BIT(fs->free_bit_map[w], index % 64);
+    fs->free_blocks++;
+    fs->groups[index / fs->group_blocks].free_blocks++;
+    FREE_BIT(fs->free_summary[w / 64], w % 64);
+
+    // Whatever the block held is garbage now, never write it back
+    cache_discard(fs->cache, index);
+
+    // The bitmap block is written at the end of the operation
+    set_dirty(&fs->map_dirty, index / fs->group_blocks);
+}
+
+//////////////////// RESERVATION WINDOWS ////////////////////
+// A growing file sets aside a run of free blocks right after its last block
+// and takes its new blocks from there, so that files growing side by side
+// do not interleave block by block. The reserved blocks are marked used in
+// memory only (see write_free_map), nothing leaks if the volume is not
+// unmounted cleanly
+
+// Gives the unused part of the window of a file back
+void release_reservation(sfs_t *fs, int inodeIdx) {
+    reservation* r = &fs->resv[inodeIdx];
+    while (r->next < r->end) free_block_at(fs, r->next++);
+    r->next = r->end = 0;
+
+    // The last file of the list takes its place
+    if (r->slot > 0){
+      int last = fs->resv_list[--fs->resv_count];
+      fs->resv_list[r->slot - 1] = last;
+      fs->resv[last].slot = r->slot;
+      r->slot = 0;
+    }
+}
+
+// Gives back the windows of all files, when the volume is full otherwise
+void release_all_reservations(sfs_t *fs) {
+    while (fs->resv_count > 0) release_reservation(fs, fs->resv_list[0]);
+}
+
+// Reserves up to want free blocks, from goal if it is free
+// Returns 0, or -1 if there is no free block at all
+int reserve_window(sfs_t *fs, int inodeIdx, int goal, int want) {
+    reservation* r = &fs->resv[inodeIdx];
+
+    int first = get_free_block_near(fs, goal);
+    if (first == -1) return -1;
+    int end = first + 1;
+    while (end - first < want && end < fs->num_blocks && (fs->free_bit_map[end / 64] & ((uint64_t)1 << (end % 64)))) use_block(fs, end++);
+
+    r->next = first;
+    r->end = end;
+    fs->groups[first / fs->group_blocks].hint = end;
+    if (r->slot == 0){
+      fs->resv_list[fs->resv_count++] = inodeIdx;
+      r->slot = fs->resv_count;
+    }
+    return 0;
+}
+
+// Allocates a block for a file, goal is where it would continue the file
+int alloc_file_block(sfs_t *fs, int inodeIdx, int goal) {
+    reservation* r = &fs->resv[inodeIdx];
+
+    if (r->next >= r->end){
+      r->size = r->size == 0 ? RESERVE_MIN : r->size * 2;
+      if (r->size > RESERVE_MAX) r->size = RESERVE_MAX;
+      if (reserve_window(fs, inodeIdx, goal, r->size) == -1){
+        // The volume is full, except maybe for what other files reserved
+        release_all_reservations(fs);
+        return get_free_block_near(fs, goal);
+      }
+    }
+
+    // The block was masked as free on disk while it was reserved
+    set_dirty(&fs->map_dirty, r->next / fs->group_blocks);
+    return r->next++;
+}
+
+// Allocates a tree block for the extent map of a file, in the group of its
+// inode. Reservations are given back if nothing else is free
+int alloc_map_block(sfs_t *fs, int inodeIdx) {
+    int block = get_next_free_block(fs, INODE_GROUP(fs, inodeIdx));
+    if (block != -1) return block;
+    release_all_reservations(fs);
+    return get_next_free_block(fs, INODE_GROUP(fs, inodeIdx));
+}
+
+//////////////////// METADATA DIRTY TRACKING ////////////////////
+// An entry can straddle two blocks of its table, mark both
+// Inode blocks are numbered group by group, fs->group_inode_blocks per group
+void mark_inode_dirty(sfs_t *fs, int inodeIdx) {
+  int base = INODE_GROUP(fs, inodeIdx) * fs->group_inode_blocks;
+  size_t offset = inodeIdx % fs->group_inodes * sizeof(inode_t);
+  set_dirty(&fs->inode_dirty, base + offset / fs->block_size);
+  set_dirty(&fs->inode_dirty, base + (offset + sizeof(inode_t) - 1) / fs->block_size);
+}
+
+void mark_dir_dirty(sfs_t *fs, int dirIdx) {
+  set_dirty(&fs->dir_dirty, dirIdx * sizeof(file_map) / fs->block_size);
+  set_dirty(&fs->dir_dirty, ((dirIdx+1) * sizeof(file_map) - 1) / fs->block_size);
+}
+
+// Copies the changed bitmap, inode table and directory blocks to the cache
+// Called once at the end of every operation that modifies them
+void write_metadata(sfs_t *fs) {
+  int i;
+  write_free_map(fs);
+  while ((i = next_dirty(&fs->inode_dirty)) != -1){
+    // The last block of a slice is only partly used
+    int g = i / fs->group_inode_blocks;
+    int b = i % fs->group_inode_blocks;
+    size_t offset = (size_t)b * fs->block_size;
+    size_t len = GROUP_INODE_SIZE(fs) - offset;
+    if (len > fs->block_size) len = fs->block_size;
+    char* inodeBlock = cache_get(fs->cache, GROUP_INODE_START(fs, g) + b, CACHE_NOREAD);
+    if (inodeBlock == NULL){
+      set_dirty(&fs->inode_dirty, i);
+      return;
+    }
+    memset(inodeBlock, 0, fs->block_size);
+    memcpy(inodeBlock, (char*)(fs->inode_table + (size_t)g*fs->group_inodes) + offset, len);
+    cache_put(fs->cache, GROUP_INODE_START(fs, g) + b, 1);
+  }
+  // The directory array is rootdir_blocks blocks long, the last one is padded
+  while ((i = next_dirty(&fs->dir_dirty)) != -1){
+    if (cache_write(fs->cache, fs->dir_blocks[i], 1, (char*)fs->root_directory + (size_t)i*fs->block_size) < 0){
+      set_dirty(&fs->dir_dirty, i);
+      return;
+    }
+  }
+}
+
+//////////////////// EXTENT MAP ////////////////////
+// A file is a sorted list of extents (logical block, first physical block,
+// length). Up to INODE_EXTENTS of them fit in the inode itself. Past that
+// they move to leaf blocks and the inode indexes the leaves instead, with up
+// to EXTENT_MAX_DEPTH levels of tree blocks below the inode (the extent
+// counterpart of double and triple indirect blocks)
+// Index entries reuse extent_t: logical is the first block the child covers,
+// start is the child block and length is unused
+#define EXTENT_MAX_DEPTH 3
+
+// A tree block of the extent map
+typedef struct {
+  int depth;      // 0 for a leaf of extents, else a block of index entries
+  int count;
+  extent_t entries[];
+} extent_node;
+#define NODE_EXTENTS(_fs) ((int)(((_fs)->block_size - sizeof(extent_node)) / sizeof(extent_t)))
+
+// Index of the last entry starting at or before logical, -1 if there is none
+int find_extent(const extent_t *list, int count, int logical) {
+  int lo = 0, hi = count;
+  while (lo < hi){
+    int mid = (lo + hi) / 2;
+    if (list[mid].logical <= logical) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo - 1;
+}
+
+// Finds the extent holding block logical of a file
+// Returns 1 and copies the extent to found, or 0 if the block is not mapped
+// An open file remembers the leaf it used last and the blocks that leaf
+// covers, so lookups close to the previous one skip the index levels
+int extent_lookup(sfs_t *fs, int inodeIdx, int logical, extent_t *found) {
+  inode_t* inode = &fs->inode_table[inodeIdx];
+  file_descriptor* fd = &fs->fd_table[inodeIdx];
+  const extent_t* list = inode->extents;
+  int count = inode->extent_count;
+  int depth = inode->extent_depth;
+  int lo = INT_MIN, hi = INT_MAX;
+  int pinned = -1;
+  int ret = 0;
+
+  if (fd->inode != 0 && fd->map_leaf > 0 && logical >= fd->map_leaf_lo && logical < fd->map_leaf_hi){
+    extent_node* node = cache_get(fs->cache, fd->map_leaf, 0);
+    if (node != NULL){
+      pinned = fd->map_leaf;
+      list = node->entries;
+      count = node->count;
+      depth = 0;
+    }
+  }
+
+  // Walk down the index levels, only the current tree block stays pinned
+  for (; depth > 0; depth--){
+    int i = find_extent(list, count, logical);
+    if (i < 0){
+      count = 0;
+      break;
+    }
+    if (i > 0) lo = list[i].logical;
+    if (i+1 < count) hi = list[i+1].logical;
+    int child = list[i].start;
+    extent_node* node = cache_get(fs->cache, child, 0);
+    if (pinned != -1) cache_put(fs->cache, pinned, 0);
+    if (node == NULL) return 0;
+    pinned = child;
+    list = node->entries;
+    count = node->count;
+    if (depth == 1 && fd->inode != 0){
+      fd->map_leaf = child;
+      fd->map_leaf_lo = lo;
+      fd->map_leaf_hi = hi;
+    }
+  }
+
+  int i = find_extent(list, count, logical);
+  if (i >= 0 && logical < list[i].logical + list[i].length){
+    *found = list[i];
+    ret = 1;
+  }
+
+  if (pinned != -1) cache_put(fs->cache, pinned, 0);
+  return ret;
+}
+
+// Finds the first extent of a list, or of the trees below its index entries,
+// that ends past block logical. Returns 1 and copies it to found, or 0
+int next_in_list(sfs_t *fs, const extent_t *list, int count, int depth, int logical, extent_t *found) {
+  int i = find_extent(list, count, logical);
+  if (i < 0) i = 0;
+  for (; i < count; i++){
+    if (depth == 0){
+      if (list[i].logical + list[i].length > logical){
+        *found = list[i];
+        return 1;
+      }
+      continue;
+    }
+
+    extent_node* node = cache_get(fs->cache, list[i].start, 0);
+    if (node == NULL) return 0;
+    int ret = next_in_list(fs, node->entries, node->count, depth - 1, logical, found);
+    cache_put(fs->cache, list[i].start, 0);
+    if (ret) return 1;
+  }
+  return 0;
+}
+
+// The extent holding block logical of a file, or else the next one after it
+int extent_next(sfs_t *fs, int inodeIdx, int logical, extent_t *found) {
+  inode_t* inode = &fs->inode_table[inodeIdx];
+  return next_in_list(fs, inode->extents, inode->extent_count, inode->extent_depth, logical, found);
+}
+
+// Two extents that can be one, the second continuing the first on disk
+int extents_continue(const extent_t *a, const extent_t *b) {
+  return a->logical + a->length == b->logical && a->start + a->length == b->start && a->unwritten == b->unwritten;
+}
+
+// Adds extent e to a sorted list of extents, growing a neighbour when e
+// continues it. Returns 0, or -1 if a new entry does not fit
+int list_insert(extent_t *list, int *count, int cap, extent_t e) {
+  int i = find_extent(list, *count, e.logical);
+
+  if (i >= 0 && extents_continue(&list[i], &e)){
+    list[i].length += e.length;
+    // The gap to the next extent may be closed now
+    if (i+1 < *count && extents_continue(&list[i], &list[i+1])){
+      list[i].length += list[i+1].length;
+      memmove(&list[i+1], &list[i+2], (*count - i - 2) * sizeof(extent_t));
+      (*count)--;
+    }
+    return 0;
+  }
+  if (i+1 < *count && extents_continue(&e, &list[i+1])){
+    list[i+1].logical = e.logical;
+    list[i+1].start = e.start;
+    list[i+1].length += e.length;
+    return 0;
+  }
+
+  if (*count >= cap) return -1;
+  memmove(&list[i+2], &list[i+1], (*count - i - 1) * sizeof(extent_t));
+  list[i+1] = e;
+  (*count)++;
+  return 0;
+}
+
+// Moves the entries held in the inode to a new tree block, which becomes
+// the only child of the inode. Returns 0, or -1 without a free block
+int push_down_root(sfs_t *fs, int inodeIdx) {
+  inode_t* inode = &fs->inode_table[inodeIdx];
+
+  int block = alloc_map_block(fs, inodeIdx);
+  if (block == -1) return -1;
+  extent_node* node = cache_get(fs->cache, block, CACHE_NOREAD);
+  if (node == NULL){
+    free_block_at(fs, block);
+    return -1;
+  }
+  node->depth = inode->extent_depth;
+  node->count = inode->extent_count;
+  memcpy(node->entries, inode->extents, inode->extent_count * sizeof(extent_t));
+  cache_put(fs->cache, block, 1);
+
+  inode->extents[0] = (extent_t){ inode->extent_count > 0 ? inode->extents[0].logical : 0, block, 0 };
+  inode->extent_count = 1;
+  inode->extent_depth++;
+  mark_inode_dirty(fs, inodeIdx);
+  return 0;
+}
+
+// Moves the upper half of a full tree block to a new one, which is pinned
+// and returned in upper along with its block number. A leaf about to grow
+// past its last extent gives nothing away, so that the leaves a file
+// growing at its end leaves behind stay full. Returns -1 without a free block
+int split_node(sfs_t *fs, int inodeIdx, extent_node *node, int logical, extent_node **upper) {
+  int block = alloc_map_block(fs, inodeIdx);
+  if (block == -1) return -1;
+  *upper = cache_get(fs->cache, block, CACHE_NOREAD);
+  if (*upper == NULL){
+    free_block_at(fs, block);
+    return -1;
+  }
 
-    // get index in array of which bit to free
-    int i = index / 8;
+  int half = node->count / 2;
+  if (node->depth == 0 && logical > node->entries[node->count-1].logical) half = node->count;
+  (*upper)->depth = node->depth;
+  (*upper)->count = node->count - half;
+  memcpy((*upper)->entries, node->entries + half, (*upper)->count * sizeof(extent_t));
+  node->count = half;
+  return block;
+}
 
-    // get which bit to free
-    uint8_t bit = index % 8;
+// Adds extent e, which must not overlap the mapped blocks, to a file
+// Full tree blocks on the way down are split before entering them, so a
+// parent always has room for the entry of a new child
+// Returns 0, or -1 if the map has no room left
+int extent_insert(sfs_t *fs, int inodeIdx, extent_t e) {
+  inode_t* inode = &fs->inode_table[inodeIdx];
+  int logical = e.logical;
+  mark_inode_dirty(fs, inodeIdx);
+
+  if (inode->extent_depth == 0 && list_insert(inode->extents, &inode->extent_count, INODE_EXTENTS, e) == 0) return 0;
+
+  // A full inode gets one level deeper, it then holds a single entry
+  // The tree changes shape then, the leaf the open file remembers may not
+  // cover the same blocks anymore
+  if (inode->extent_count == INODE_EXTENTS && inode->extent_depth < EXTENT_MAX_DEPTH){
+    if (push_down_root(fs, inodeIdx) == -1) return -1;
+    fs->fd_table[inodeIdx].map_leaf = 0;
+  }
 
-    // free bit
-    FREE_BIT(free_bit_map[i], bit);
+  extent_t* list = inode->extents;
+  int* count = &inode->extent_count;
+  int cap = INODE_EXTENTS;
+  int parent = -1, parentDirty = 0;
+
+  for (int depth = inode->extent_depth; depth > 0; depth--){
+    // The child covering the block, the first one also takes blocks before it
+    int i = find_extent(list, *count, logical);
+    if (i < 0){
+      i = 0;
+      list[0].logical = logical;
+      parentDirty = 1;
+    }
+    int child = list[i].start;
+    extent_node* node = cache_get(fs->cache, child, 0);
+    if (node == NULL){
+      if (parent != -1) cache_put(fs->cache, parent, parentDirty);
+      return -1;
+    }
 
-    // Write the new table back to memory
-    char* tempBlock = calloc(BLOCK_SIZE,1);
-    memcpy(tempBlock, free_bit_map, sizeof(free_bit_map));
-    write_blocks(NUM_BLOCKS-FREE_MAP_BLOCKS, FREE_MAP_BLOCKS, tempBlock);
-    free(tempBlock);
+    if (node->count >= NODE_EXTENTS(fs)){
+      extent_node* upper;
+      int upperBlock = *count < cap ? split_node(fs, inodeIdx, node, logical, &upper) : -1;
+      if (upperBlock == -1){
+        if (DEBUG==1) printf("Extent map of inode %d is full \n", inodeIdx);
+        cache_put(fs->cache, child, 0);
+        if (parent != -1) cache_put(fs->cache, parent, parentDirty);
+        return -1;
+      }
+      int upperStart = upper->count > 0 ? upper->entries[0].logical : logical;
+
+      memmove(&list[i+2], &list[i+1], (*count - i - 1) * sizeof(extent_t));
+      list[i+1] = (extent_t){ upperStart, upperBlock, 0 };
+      (*count)++;
+      parentDirty = 1;
+      fs->fd_table[inodeIdx].map_leaf = 0;
+
+      // Go on in whichever half covers the block
+      if (logical >= upperStart){
+        cache_put(fs->cache, child, 1);
+        child = upperBlock;
+        node = upper;
+      }
+      else cache_put(fs->cache, upperBlock, 1);
+    }
+
+    if (parent != -1) cache_put(fs->cache, parent, parentDirty);
+    parent = child;
+    parentDirty = 0;
+    list = node->entries;
+    count = &node->count;
+    cap = NODE_EXTENTS(fs);
+  }
+
+  int ret = list_insert(list, count, cap, e);
+  if (parent != -1) cache_put(fs->cache, parent, 1);
+  if (ret == -1 && DEBUG==1) printf("Extent map of inode %d is full \n", inodeIdx);
+  return ret;
+}
+
+// Overwrites the extent of a file that starts at block key with e, which
+// covers the same blocks or fewer. A written e is joined with a neighbour
+// it continues. Returns 0, or -1 if there is no such extent
+int extent_update(sfs_t *fs, int inodeIdx, int key, extent_t e) {
+  inode_t* inode = &fs->inode_table[inodeIdx];
+  extent_t* list = inode->extents;
+  int* count = &inode->extent_count;
+  int pinned = -1;
+
+  for (int depth = inode->extent_depth; depth > 0; depth--){
+    int i = find_extent(list, *count, key);
+    if (i < 0) i = 0;
+    int child = list[i].start;
+    extent_node* node = cache_get(fs->cache, child, 0);
+    if (pinned != -1) cache_put(fs->cache, pinned, 0);
+    if (node == NULL) return -1;
+    pinned = child;
+    list = node->entries;
+    count = &node->count;
+  }
+
+  int i = find_extent(list, *count, key);
+  if (i >= 0 && list[i].logical == key){
+    list[i] = e;
+    if (!e.unwritten && i+1 < *count && extents_continue(&list[i], &list[i+1])){
+      list[i].length += list[i+1].length;
+      memmove(&list[i+1], &list[i+2], (*count - i - 2) * sizeof(extent_t));
+      (*count)--;
+    }
+    if (!e.unwritten && i > 0 && extents_continue(&list[i-1], &list[i])){
+      list[i-1].length += list[i].length;
+      memmove(&list[i], &list[i+1], (*count - i - 1) * sizeof(extent_t));
+      (*count)--;
+    }
+  }
+  else i = -1;
+
+  if (pinned != -1) cache_put(fs->cache, pinned, i >= 0);
+  else mark_inode_dirty(fs, inodeIdx);
+
+  // The open file may remember the extent as it was
+  fs->fd_table[inodeIdx].map_extent.length = 0;
+  return i >= 0 ? 0 : -1;
+}
+
+// Turns blocks logical up to logical+n of a file, all inside the unwritten
+// extent old, into written ones. The extent is cut in up to three pieces,
+// one step at a time so that a failed step can put the previous map back
+// Returns 0, or -1 if the map has no room for the pieces
+int extent_written(sfs_t *fs, int inodeIdx, extent_t old, int logical, int n) {
+  extent_t head = old, mid = old, tail = old;
+  head.length = logical - old.logical;
+  mid.logical = logical;
+  mid.start = old.start + head.length;
+  mid.length = n;
+  mid.unwritten = 0;
+  tail.logical = logical + n;
+  tail.start = mid.start + n;
+  tail.length = old.length - head.length - n;
+
+  if (head.length == 0 && tail.length == 0) return extent_update(fs, inodeIdx, old.logical, mid);
+
+  // What stays unwritten keeps the entry, the written part is added to it
+  if (head.length == 0){
+    if (extent_update(fs, inodeIdx, old.logical, tail) == -1) return -1;
+    if (extent_insert(fs, inodeIdx, mid) == -1){
+      extent_update(fs, inodeIdx, tail.logical, old);
+      return -1;
+    }
+    return 0;
+  }
+
+  if (extent_update(fs, inodeIdx, old.logical, head) == -1) return -1;
+  if (tail.length > 0 && extent_insert(fs, inodeIdx, tail) == -1){
+    extent_update(fs, inodeIdx, old.logical, old);
+    return -1;
+  }
+  if (extent_insert(fs, inodeIdx, mid) == -1){
+    // The head takes the blocks back, unwritten as they were
+    head.length += n;
+    extent_update(fs, inodeIdx, old.logical, head);
+    return -1;
+  }
+  return 0;
+}
+
+// Frees the blocks of a list of extents, or of every tree below a list of
+// index entries (depth > 0) along with the tree blocks
+void free_extents(sfs_t *fs, const extent_t *list, int count, int depth) {
+  for (int i = 0; i < count; i++){
+    if (depth == 0){
+      for (int b = 0; b < list[i].length; b++) free_block_at(fs, list[i].start + b);
+      continue;
+    }
+
+    extent_node* node = cache_get(fs->cache, list[i].start, 0);
+    if (node != NULL){
+      free_extents(fs, node->entries, node->count, depth - 1);
+      cache_put(fs->cache, list[i].start, 0);
+    }
+    free_block_at(fs, list[i].start);
+  }
 }
 
 //////////////////// CREATE AN INODE ////////////////////
 // These already exist in memory, so don't need to get next free blocks or anything
-int create_inode(){
-  for (int i = 0; i < NUM_INODES; i ++){
-    // Overloading one of the fields... typically considered bad practice
-    // If mode is <= 0
-    if (inode_table[i].mode <= 0 || inode_table[i].mode > 1){
-      // Set some parameters, not sure what to set UID or GID to
-      inode_table[i].mode = 1;
-      inode_table[i].indirect_ptr = 0;
-
-      // Return the index of the inode
-      return i;
-    }
+int inode_is_free(sfs_t *fs, int inodeIdx){
+  // Overloading one of the fields... typically considered bad practice
+  // If mode is <= 0
+  return fs->inode_table[inodeIdx].mode <= 0 || fs->inode_table[inodeIdx].mode > 1;
+}
+
+// Counts the free inodes of every group, after the table was loaded or created
+void init_inode_counts(sfs_t *fs){
+  for (int g = 0; g < fs->num_groups; g++){
+    fs->groups[g].free_inodes = 0;
+    fs->groups[g].inode_hint = g * fs->group_inodes;
+  }
+  for (int i = 0; i < fs->num_inodes; i++){
+    if (inode_is_free(fs, i)) fs->groups[INODE_GROUP(fs, i)].free_inodes++;
   }
+}
 
-  return -1;
+int create_inode(sfs_t *fs){
+  // A new file goes to the group with the most free blocks, its data will
+  // grow next to it and the groups fill up evenly
+  int best = -1;
+  for (int g = 0; g < fs->num_groups; g++){
+    if (fs->groups[g].free_inodes == 0) continue;
+    if (best == -1 || fs->groups[g].free_blocks > fs->groups[best].free_blocks) best = g;
+  }
+  if (best == -1) return -1;
+
+  // Next fit inside the group, the counter says there is a free one
+  int first = best * fs->group_inodes;
+  int end = first + fs->group_inodes;
+  if (end > fs->num_inodes) end = fs->num_inodes;
+  int i = fs->groups[best].inode_hint;
+  if (i < first || i >= end) i = first;
+  while (!inode_is_free(fs, i)){
+    if (++i == end) i = first;
+  }
+  fs->groups[best].free_inodes--;
+  fs->groups[best].inode_hint = i + 1;
+
+  // Set some parameters, not sure what to set UID or GID to
+  fs->inode_table[i].mode = 1;
+  fs->inode_table[i].extent_depth = 0;
+  fs->inode_table[i].extent_count = 0;
+  fs->inode_table[i].inline_data = JITS_INLINE_DATA;
+  memset(fs->inode_table[i].data, 0, INODE_INLINE);
+  mark_inode_dirty(fs, i);
+
+  // Return the index of the inode
+  return i;
+}
+
+//////////////////// NAME INDEX ////////////////////
+// Hash table from file name to inode number over the directory in memory,
+// so that finding a file does not go through the whole directory. Linear
+// probing, 0 is an empty slot (inode 0 is the root directory, not a file)
+// There are at least twice as many slots as inodes, so probes stay short
+
+unsigned int name_hash(const char *name){
+  // FNV-1a of the first MAXFILENAME characters, the part that is compared
+  unsigned int h = 2166136261u;
+  for (int i = 0; i < MAXFILENAME && name[i] != '\0'; i++) h = (h ^ (unsigned char)name[i]) * 16777619u;
+  return h;
+}
+
+// The slot of the file called name, or the empty slot ending its probe
+int name_slot(sfs_t *fs, const char *name){
+  int mask = fs->name_slots - 1;
+  int s = name_hash(name) & mask;
+  while (fs->name_index[s] != 0 && strncmp(name, fs->root_directory[fs->name_index[s]].filename, MAXFILENAME) != 0) s = (s + 1) & mask;
+  return s;
+}
+
+// Adds a file, its directory entry must hold its name already
+void name_insert(sfs_t *fs, int inodeIdx){
+  fs->name_index[name_slot(fs, fs->root_directory[inodeIdx].filename)] = inodeIdx;
+}
+
+// Removes a file, before its directory entry is cleared. The entries
+// after it move back into the hole so that no probe stops early
+void name_remove(sfs_t *fs, int inodeIdx){
+  int mask = fs->name_slots - 1;
+  int s = name_slot(fs, fs->root_directory[inodeIdx].filename);
+  if (fs->name_index[s] != inodeIdx) return;
+  fs->name_index[s] = 0;
+
+  for (int n = (s + 1) & mask; fs->name_index[n] != 0; n = (n + 1) & mask){
+    // An entry whose probe starts between the hole and itself stays
+    int home = name_hash(fs->root_directory[fs->name_index[n]].filename) & mask;
+    if (s < n ? (home > s && home <= n) : (home > s || home <= n)) continue;
+    fs->name_index[s] = fs->name_index[n];
+    fs->name_index[n] = 0;
+    s = n;
+  }
+}
+
+
+//////////////////// GEOMETRY ////////////////////
+// Block size, volume size and inode count are chosen when the volume is
+// formatted (sfs_format) and kept in its superblock, the layout and the
+// size of every table in memory follow from them
+
+// Fills in the superblock of a new volume, fields of geometry that are 0
+// (or all of them if it is NULL) take the JITS_ defaults
+void init_superblock(superblock_t *sb, const sfs_geometry *geometry) {
+    sfs_geometry g = { 0 };
+    if (geometry != NULL) g = *geometry;
+    if (g.block_size == 0) g.block_size = JITS_BLOCK_SIZE;
+    if (g.num_blocks == 0) g.num_blocks = JITS_NUM_BLOCKS;
+    if (g.num_inodes == 0) g.num_inodes = JITS_NUM_INODES;
+    if (g.group_blocks == 0) g.group_blocks = geometry == NULL ? JITS_GROUP_BLOCKS : 8 * g.block_size;
+
+    memset(sb, 0, sizeof(*sb));
+    sb->magic = SFS_MAGIC;
+    sb->block_size = g.block_size;
+    sb->fs_size = g.num_blocks;
+    sb->group_blocks = g.group_blocks;
+    sb->inode_count = g.num_inodes;
+    sb->root_dir_inode = 0;
+}
+
+// Works out the layout of the volume a superblock describes
+// Returns 0, or -1 if it is not a volume this code can use
+int set_geometry(sfs_t *fs, const superblock_t *sb) {
+    if (sb->magic != SFS_MAGIC){
+      if (DEBUG==1) printf("Not a file system volume (magic %x) \n", sb->magic);
+      return -1;
+    }
+    if (sb->block_size < MIN_BLOCK_SIZE || sb->block_size > MAX_BLOCK_SIZE || (sb->block_size & (sb->block_size - 1)) != 0 ||
+        sb->group_blocks < 64 || sb->group_blocks % 64 != 0 || sb->group_blocks > 8 * sb->block_size ||
+        sb->fs_size < 2 || sb->fs_size > INT_MAX - sb->group_blocks ||
+        sb->inode_count < 1 || sb->inode_count > INT_MAX / (int)sizeof(inode_t)){
+      if (DEBUG==1) printf("Bad geometry: block size %d, %d blocks, %d inodes, %d blocks per group \n",
+                           sb->block_size, sb->fs_size, sb->inode_count, sb->group_blocks);
+      return -1;
+    }
+
+    fs->block_size = sb->block_size;
+    fs->num_blocks = sb->fs_size;
+    fs->num_inodes = sb->inode_count;
+    fs->group_blocks = sb->group_blocks;
+    fs->num_groups = (fs->num_blocks + fs->group_blocks - 1) / fs->group_blocks;
+    fs->group_inodes = (fs->num_inodes + fs->num_groups - 1) / fs->num_groups;
+    fs->group_inode_blocks = (GROUP_INODE_SIZE(fs) + fs->block_size - 1) / fs->block_size;
+    fs->rootdir_blocks = ((size_t)fs->num_inodes * sizeof(file_map) + fs->block_size - 1) / fs->block_size;
+    fs->map_words = fs->num_groups * (fs->group_blocks / 64);
+
+    // Every group, the last one shorter than the others, needs room for its
+    // bitmap and inodes and some data
+    int firstBlocks = fs->num_groups == 1 ? fs->num_blocks : fs->group_blocks;
+    int lastBlocks = fs->num_blocks - (fs->num_groups - 1) * fs->group_blocks;
+    if (2 + fs->group_inode_blocks >= firstBlocks || (fs->num_groups > 1 && 1 + fs->group_inode_blocks >= lastBlocks)){
+      if (DEBUG==1) printf("%d inodes do not fit in groups of %d blocks \n", fs->num_inodes, fs->group_blocks);
+      return -1;
+    }
+    return 0;
+}
+
+// The root directory starts after the inodes of group 0. One too large for
+// the group goes on after the inodes of the next groups, dir_blocks says
+// where each of its blocks is. Returns -1 if the volume is too small for it
+int place_root_directory(sfs_t *fs) {
+    int b = GROUP_INODE_START(fs, 0) + fs->group_inode_blocks;
+    for (int i = 0; i < fs->rootdir_blocks; i++, b++){
+      // Step over the bitmap and inodes at the start of the next group
+      if (b % fs->group_blocks == 0) b += 1 + fs->group_inode_blocks;
+      if (b >= fs->num_blocks){
+        if (DEBUG==1) printf("The root directory does not fit in %d blocks \n", fs->num_blocks);
+        return -1;
+      }
+      fs->dir_blocks[i] = b;
+    }
+    return 0;
 }
 
+// Allocates the tables of a volume in memory, sized from its geometry
+// Returns the volume, or NULL if sb is not usable or memory runs out
+sfs_t* new_volume(const superblock_t *sb) {
+    sfs_t* fs = calloc(1, sizeof(sfs_t));
+    if (fs == NULL) return NULL;
+    if (set_geometry(fs, sb) == -1){
+      free(fs);
+      return NULL;
+    }
+    fs->sb = *sb;
+
+    fs->name_slots = 1;
+    while (fs->name_slots < 2 * fs->num_inodes) fs->name_slots *= 2;
+
+    fs->free_bit_map = malloc((size_t)fs->map_words * sizeof(uint64_t));
+    fs->free_summary = calloc(FREE_SUMMARY_WORDS(fs), sizeof(uint64_t));
+    fs->groups = calloc(fs->num_groups, sizeof(block_group));
+    fs->resv = calloc(fs->num_inodes, sizeof(reservation));
+    fs->resv_list = calloc(fs->num_inodes, sizeof(int));
+    fs->inode_table = calloc((size_t)fs->num_groups * fs->group_inodes, sizeof(inode_t));
+    fs->fd_table = calloc(fs->num_inodes, sizeof(file_descriptor));
+    fs->root_directory = calloc(fs->rootdir_blocks, fs->block_size);
+    fs->dir_blocks = calloc(fs->rootdir_blocks, sizeof(int));
+    fs->name_index = calloc(fs->name_slots, sizeof(int));
+    fs->map_dirty.flags = calloc(fs->num_groups, 1);
+    fs->inode_dirty.flags = calloc((size_t)fs->num_groups * fs->group_inode_blocks, 1);
+    fs->dir_dirty.flags = calloc(fs->rootdir_blocks, 1);
+    if (fs->free_bit_map == NULL || fs->free_summary == NULL || fs->groups == NULL || fs->resv == NULL ||
+        fs->resv_list == NULL || fs->inode_table == NULL || fs->fd_table == NULL || fs->root_directory == NULL ||
+        fs->dir_blocks == NULL || fs->name_index == NULL || fs->map_dirty.flags == NULL ||
+        fs->inode_dirty.flags == NULL || fs->dir_dirty.flags == NULL || place_root_directory(fs) == -1){
+      sfs_unmount(fs);
+      return NULL;
+    }
+
+    memset(fs->free_bit_map, UINT8_MAX, (size_t)fs->map_words * sizeof(uint64_t));
+    init_free_summary(fs);
+    return fs;
+}
 
-void init_superblock() {
-    sb.magic = 0xACBD0005;
-    sb.block_size = BLOCK_SIZE;
-    sb.fs_size = NUM_BLOCKS * BLOCK_SIZE;
-    sb.inode_table_len = NUM_INODE_BLOCKS;
-    sb.root_dir_inode = 0;
+// Reads the superblock of an existing volume. The block size is only known
+// once it is read, so block 0 is read as a MIN_BLOCK_SIZE block first, with
+// plain pread whatever mode config says (the device model still applies)
+// Returns 0, or -1 if the disk cannot be read
+int read_superblock(char *disk_name, const disk_config *config, superblock_t *sb) {
+    disk_config probe = *config;
+    probe.mode = DISK_PIO;
+
+    disk_t* disk = disk_open(disk_name, MIN_BLOCK_SIZE, 1, &probe);
+    if (disk == NULL) return -1;
+    char* block = disk_get_buffer(disk);
+    int ret = block != NULL && disk_read(disk, 0, 1, block) == 1 ? 0 : -1;
+    if (ret == 0) memcpy(sb, block, sizeof(*sb));
+    if (block != NULL) disk_put_buffer(disk, block);
+    disk_close(disk);
+    return ret;
+}
+
+
+// Reads the bitmap and inode table slice of every group and the root
+// directory of a volume being mounted. Returns 0, or -1 if a read failed
+int read_metadata(sfs_t *fs) {
+    // Whole inode blocks go straight to the table, the partly used last one
+    // of a slice through the cache
+    size_t wholeInodeBlocks = GROUP_INODE_SIZE(fs) / fs->block_size;
+    size_t tail = GROUP_INODE_SIZE(fs) % fs->block_size;
+    for (int g = 0; g < fs->num_groups; g++){
+      char* mapBlock = cache_get(fs->cache, GROUP_MAP(fs, g), 0);
+      if (mapBlock == NULL) return -1;
+      memcpy((char*)fs->free_bit_map + (size_t)g*fs->group_blocks/8, mapBlock, fs->group_blocks/8);
+      cache_put(fs->cache, GROUP_MAP(fs, g), 0);
+
+      char* slice = (char*)(fs->inode_table + (size_t)g*fs->group_inodes);
+      if (wholeInodeBlocks > 0 && cache_read_direct(fs->cache, GROUP_INODE_START(fs, g), wholeInodeBlocks, slice) < 0) return -1;
+      if (tail > 0){
+        int last = GROUP_INODE_START(fs, g) + wholeInodeBlocks;
+        char* inodeBlock = cache_get(fs->cache, last, 0);
+        if (inodeBlock == NULL) return -1;
+        memcpy(slice + wholeInodeBlocks * fs->block_size, inodeBlock, tail);
+        cache_put(fs->cache, last, 0);
+      }
+    }
+
+    // The directory in runs of consecutive blocks
+    for (int i = 0; i < fs->rootdir_blocks;){
+      int n = 1;
+      while (i + n < fs->rootdir_blocks && fs->dir_blocks[i + n] == fs->dir_blocks[i] + n) n++;
+      if (cache_read_direct(fs->cache, fs->dir_blocks[i], n, (char*)fs->root_directory + (size_t)i*fs->block_size) < 0) return -1;
+      i += n;
+    }
+    return 0;
 }
 
 
@@ -194,61 +1225,165 @@ void init_superblock() {
 ///////////////////////////////////////////////////////////////////////////////
 
 
-void mksfs(int fresh) {
-	//Implement mksfs here
-  // Formats the virtual disk implemented
+sfs_t* sfs_format(char *disk_name, const sfs_geometry *geometry, const disk_config *config) {
+  // Formats the virtual disk implemented, with the given geometry
   // Creates an instance of the simple file system on top of it
   // Instantiate all the in memory data structures
   // Open file descriptor table, inode cache, disk block cache, root dir cache
-  if (fresh) {	
-    // File system is created from scratch
-    if (DEBUG==1) printf("making new file system\n");
-
-    // create super block
-    init_superblock();
-    init_fresh_disk(JITS_DISK, BLOCK_SIZE, NUM_BLOCKS);
-    write_blocks(get_next_free_block(), 1, &sb);
-
-
-    // Instantiate some important values
-    // instantiate the inode table
-    for (int i = 0; i < NUM_INODES; i++){
-      inode_table[i].mode = 0;
-      // Set this to be the first spot after the i-nodes
-      // inode_table[i].EOF_block = 1+sb.inode_table_len+NUM_ROOTDIR_BLOCKS;
-      // inode_table[i].EOF_offset = 0;
-    }
-    // Set all of these for my naive overloading of inode field
-    for (int i = 0; i < NUM_INODES; i++){
-      fd_table[i].inode = 0;
-    }
-    // Set the location of the root node
-    // The root directory will be at the sb.root_dir_inode (0)
-    inode_table[sb.root_dir_inode].mode = 1;
-
-
-    // write inode table
-    write_blocks(get_next_free_block(), sb.inode_table_len, inode_table);
-  } 
-  else {
-    if (DEBUG==1) printf("reopening file system\n");
-    // open super block
-    read_blocks(0, 1, &sb);
-    if (DEBUG==1) printf("Block Size is: %lu\n", sb.block_size);
-    
-    // open inode table
-    read_blocks(1, NUM_INODE_BLOCKS, inode_table);
-    
-    // open directory
-    read_blocks(1+NUM_INODES, NUM_ROOTDIR_BLOCKS, root_directory);
-
-    // open free block list
-    write_blocks(NUM_BLOCKS-FREE_MAP_BLOCKS, FREE_MAP_BLOCKS, free_bit_map);
-  }
-  return;
+  disk_config defaults = { JITS_DISK_MODE, JITS_STRIPE_UNIT, JITS_DISK_MODEL };
+  if (config == NULL) config = &defaults;
+  if (DEBUG==1) printf("making new file system\n");
+
+  superblock_t sb;
+  init_superblock(&sb, geometry);
+  sfs_t* fs = new_volume(&sb);
+  if (fs == NULL) return NULL;
+  fs->sb.inode_table_len = fs->num_groups * fs->group_inode_blocks;
+
+  fs->disk = disk_create(disk_name, fs->block_size, fs->num_blocks, config);
+  if (fs->disk != NULL) fs->cache = cache_create(fs->disk, JITS_CACHE_BLOCKS);
+  if (fs->cache == NULL){
+    sfs_unmount(fs);
+    return NULL;
+  }
+
+  // create super block
+  // The superblock is smaller than a block, pad it out
+  int sbIdx = 0;
+  use_block(fs, sbIdx);
+  char* sbBlock = cache_get(fs->cache, sbIdx, CACHE_NOREAD);
+  memcpy(sbBlock, &fs->sb, sizeof(fs->sb));
+  cache_put(fs->cache, sbIdx, 1);
+
+
+  // Instantiate some important values
+  // The inode table and fd table start out zeroed (mode 0, inode 0)
+  // Set the location of the root node
+  // The root directory will be at the sb.root_dir_inode (0)
+  fs->inode_table[fs->sb.root_dir_inode].mode = 1;
+  init_inode_counts(fs);
+
+
+  // Reserve the bitmap and inode blocks of every group and the root
+  // directory blocks. The new image reads back as 0's, so of the inode
+  // table and directory only the block with the root inode is written
+  for (int g = 0; g < fs->num_groups; g++){
+    for (int i = GROUP_MAP(fs, g); i < GROUP_INODE_START(fs, g) + fs->group_inode_blocks; i++) use_block(fs, i);
+  }
+  for (int i = 0; i < fs->rootdir_blocks; i++) use_block(fs, fs->dir_blocks[i]);
+  mark_inode_dirty(fs, fs->sb.root_dir_inode);
+  write_metadata(fs);
+  return fs;
 }
 
-int sfs_get_next_filename(char *fname) {
+sfs_t* sfs_mount(char *disk_name, int fresh, const disk_config *config) {
+  // Mounts the volume on the disk, a fresh one gets the default geometry
+  // An existing one is laid out as its superblock says
+  disk_config defaults = { JITS_DISK_MODE, JITS_STRIPE_UNIT, JITS_DISK_MODEL };
+  if (config == NULL) config = &defaults;
+  if (fresh) return sfs_format(disk_name, NULL, config);
+
+  if (DEBUG==1) printf("reopening file system\n");
+
+  // open super block
+  superblock_t sb;
+  if (read_superblock(disk_name, config, &sb) == -1) return NULL;
+  if (DEBUG==1) printf("Block Size is: %d\n", sb.block_size);
+  sfs_t* fs = new_volume(&sb);
+  if (fs == NULL) return NULL;
+  if (sb.inode_table_len != fs->num_groups * fs->group_inode_blocks){
+    if (DEBUG==1) printf("Inode table length %d does not match the geometry \n", sb.inode_table_len);
+    sfs_unmount(fs);
+    return NULL;
+  }
+
+  fs->disk = disk_open(disk_name, fs->block_size, fs->num_blocks, config);
+  if (fs->disk != NULL) fs->cache = cache_create(fs->disk, JITS_CACHE_BLOCKS);
+  if (fs->cache == NULL){
+    sfs_unmount(fs);
+    return NULL;
+  }
+
+  // open the bitmaps, inode table slices and directory
+  // A volume missing any of them is not mounted, its unread groups would
+  // look all free and its files missing
+  if (read_metadata(fs) == -1){
+    if (DEBUG==1) printf("Could not read the file system metadata\n");
+    sfs_unmount(fs);
+    return NULL;
+  }
+  for (int i = 1; i < fs->num_inodes; i++){
+    if (fs->root_directory[i].filename[0] != '\0' && fs->root_directory[i].inode > 0) name_insert(fs, i);
+  }
+
+  init_free_summary(fs);
+  init_inode_counts(fs);
+  return fs;
+}
+
+// See DELAYED ALLOCATION
+int flush_delayed(sfs_t *fs, int fileID);
+
+int sfs_sync(sfs_t *fs) {
+  // Writes back every dirty cached block and waits until the disk has it
+  if (fs == NULL) return -1;
+  int ret = 0;
+  for (int i = 0; i < fs->num_inodes; i++){
+    if (flush_delayed(fs, i) == -1) ret = -1;
+  }
+  write_metadata(fs);
+  if (cache_sync(fs->cache) == -1) ret = -1;
+  return ret;
+}
+
+//////////////////// PER FILE BLOCK MAP ////////////////////
+// Every open file remembers the extent it used last, so the data path does
+// not walk the extent map again while it stays inside one extent
+
+// Forgets it, when the file is closed, truncated or removed
+void invalidate_block_map(sfs_t *fs, int fileID) {
+  fs->fd_table[fileID].map_extent.length = 0;
+  fs->fd_table[fileID].map_leaf = 0;
+}
+
+int sfs_unmount(sfs_t *fs) {
+  // Writes everything back, releases the in memory structures and closes the disk
+  if (fs == NULL) return -1;
+
+  for (int i = 0; fs->fd_table != NULL && i < fs->num_inodes; i++){
+    if (fs->cache != NULL) flush_delayed(fs, i);
+    free(fs->fd_table[i].da_buf);
+    invalidate_block_map(fs, i);
+  }
+  if (fs->cache != NULL) write_metadata(fs);
+  cache_destroy(fs->cache);
+  if (fs->disk != NULL){
+    disk_sync(fs->disk);
+    disk_close(fs->disk);
+  }
+  free(fs->free_bit_map);
+  free(fs->free_summary);
+  free(fs->groups);
+  free(fs->resv);
+  free(fs->resv_list);
+  free(fs->inode_table);
+  free(fs->fd_table);
+  free(fs->root_directory);
+  free(fs->dir_blocks);
+  free(fs->name_index);
+  free(fs->map_dirty.flags);
+  free(fs->inode_dirty.flags);
+  free(fs->dir_dirty.flags);
+  free(fs);
+  return 0;
+}
+
+disk_t* sfs_disk(sfs_t *fs) {
+  // The disk under a volume, e.g. for its I/O counters (disk_get_stats)
+  return fs->disk;
+}
+
+int sfs_next_filename(sfs_t *fs, char *fname) {
   // Copies the name of the next file in the directory into fname
   // Returns a non-zero if there is a new file
   // Once all of the files have been returned, this function returns 0
@@ -256,25 +1391,32 @@ int sfs_get_next_filename(char *fname) {
   // Ensure that the function remembers the current position in the dir at each call
   // Facilitated by the single level directory structure
 
-  // Get the next file name according to the indexing variable 
-  file_map curFile = root_directory[nextFilenameIdx];
+  // The directory has one entry per inode
+  if (fs->nextFilenameIdx >= fs->num_inodes){
+    fs->nextFilenameIdx = 0;
+    return 0;
+  }
+
+  // Get the next file name according to the indexing variable
+  file_map curFile = fs->root_directory[fs->nextFilenameIdx];
   if (DEBUG==1) printf("%d", curFile.inode);
 
-  // If curFile has a null name or inode then clearly invalid
-  if (curFile.filename == NULL || curFile.inode <= 0) {
-    nextFilenameIdx = 0;
+  // If curFile has an empty name or null inode then clearly invalid
+  if (curFile.filename[0] == '\0' || curFile.inode <= 0) {
+    fs->nextFilenameIdx = 0;
     return 0;
   }
 
-  // length is wrong in this case, not null terminated?
+  // Names of MAXFILENAME characters fill fname without a terminator
   int copySize = strlen(curFile.filename);
-  if (strlen(curFile.filename) > MAXFILENAME) copySize = MAXFILENAME;
+  if (copySize > MAXFILENAME) copySize = MAXFILENAME;
 
   // Copy the filename into fname according to the size of the filename
   memcpy(fname, curFile.filename, copySize);
-  
+  if (copySize < MAXFILENAME) fname[copySize] = '\0';
+
   // increment the filename looper index
-  nextFilenameIdx ++;
+  fs->nextFilenameIdx ++;
 
   // return the inode of the file on success
 	return curFile.inode;
@@ -295,11 +1437,11 @@ int sfs_get_next_filename(char *fname) {
   file_map curFile = root_directory[nextFilenameIdx];
 
   // If curFile has a null name or inode then clearly invalid
-  // But due to how the file system is set up in the system, 
+  // But due to how the file system is set up in the system,
   // these are bound to happen (i.e. it's all full of holes)
   // So just skip them, but break if the directory size has been reached
   while (nextFilenameIdx < NUM_INODES) {
-    // Get the next file name according to the indexing variable 
+    // Get the next file name according to the indexing variable
     file_map curFile = root_directory[nextFilenameIdx];
     if (DEBUG==1) printf("%d", curFile.inode);
     nextFilenameIdx ++;
@@ -320,7 +1462,7 @@ int sfs_get_next_filename(char *fname) {
 
   // Copy the filename into fname according to the size of the filename
   memcpy(fname, curFile.filename, copySize);
-  
+
   // return the inode of the file on success
 	return curFile.inode;
 }
@@ -342,7 +1484,7 @@ int get_inode_from_name(const char* name){
     printf("made it");
     // Don't want to exceed the index
     if (nextFilenameIdx >= NUM_INODES) return -1;
-    
+
     // Compare the two strings, return the inode if there is a match
     if (DEBUG==1) printf("Comparing %s,%s\n", copyName, name);
     if (strncmp(copyName, name, MAXFILENAME) == 0) return inode;
@@ -356,36 +1498,27 @@ int get_inode_from_name(const char* name){
 
 //////////////////// GET INODE FROM NAME /////////////////////
 // Get the inode number from the root directory using the name
-int get_inode_from_name(char* name){
-  // Iterate over the entire directory in memory.
+int get_inode_from_name(sfs_t *fs, const char* name){
+  // The name index gives the slot of the file, or an empty one
   // If a file exists by that name, return its inode number
-  for (int i = 0; i < NUM_INODES; i ++){
-    file_map curFile = root_directory[i];
-
-    // If curFile has a null name or inode then clearly invalid
-    if (curFile.filename == NULL || curFile.inode <= 0) continue;
-
-
-    // Compare the two strings, return the inode if there is a match
-    if (strncmp(name, curFile.filename, MAXFILENAME) == 0) return curFile.inode;
-    if (DEBUG==1) printf("Comparing %s,%s\n", name, curFile.filename);
-  }
+  int inodeIdx = fs->name_index[name_slot(fs, name)];
+  if (inodeIdx != 0) return inodeIdx;
 
   // If no file found then return -1
   return -1;
 }
 
 // Is path different than name?
-int sfs_GetFileSize(const char* path) {
+int sfs_size(sfs_t *fs, const char* path) {
   // Returns the size of a given file
-  
+
   // Get the inode corresponding to the name of the file
-  int inode = get_inode_from_name(path);
+  int inode = get_inode_from_name(fs, path);
   if (inode == -1) return -1;
-	return inode_table[inode].size;
+	return fs->inode_table[inode].size;
 }
 
-int sfs_fopen(char *name) {
+int sfs_open(sfs_t *fs, char *name) {
 // Create a file (part of the open() call)
 //    Allocate and init an inode
 //        Need to somehow remember state of inode table to find which inode
@@ -402,7 +1535,7 @@ int sfs_fopen(char *name) {
   period = strrchr(name, '.');
   int extensionSize = strlen(name) - (period-name+1);
 
-  if (DEBUG==1) printf("\nOpening %s \n", name);  
+  if (DEBUG==1) printf("\nOpening %s \n", name);
   if (strlen(name) >= MAXFILENAME+1){
     if (DEBUG==1) printf("Name is too long at %d characters \n", strlen(name));
     return -1;
@@ -413,202 +1546,325 @@ int sfs_fopen(char *name) {
   }
 
   // Find the file in the root directory
-  int inodeIdx = get_inode_from_name(name);
-  
+  int inodeIdx = get_inode_from_name(fs, name);
+
   // If the inode idx is <= it is either the root dir or invalid
   // Create the file if it doesn't already exist
   if (inodeIdx == -1){
     // Need to create an inode
     if (DEBUG==1) printf("No file found, creating one ");
-    inodeIdx = create_inode();
+    inodeIdx = create_inode(fs);
     if (DEBUG==1) printf("at index %d \n", inodeIdx);
+    if (inodeIdx == -1) return -1;
 
     // Root dir idx is the inode idx
-    root_directory[inodeIdx].filename = name;
-    root_directory[inodeIdx].inode = inodeIdx;
+    // The name is kept in the entry itself so that it survives a remount
+    strncpy(fs->root_directory[inodeIdx].filename, name, MAXFILENAME);
+    fs->root_directory[inodeIdx].filename[MAXFILENAME] = '\0';
+    fs->root_directory[inodeIdx].inode = inodeIdx;
+    mark_dir_dirty(fs, inodeIdx);
+    name_insert(fs, inodeIdx);
 
     if (DEBUG==1) printf("File created at inode %d  \n", inodeIdx);
   }
 
   // Check to see if the inode already exists in the table, if it does do not open twice
-  if (fd_table[inodeIdx].inode <= 0){
+  if (fs->fd_table[inodeIdx].inode <= 0){
     // Set the inode number to be the proper inode
-    fd_table[inodeIdx].inode = inodeIdx;
+    fs->fd_table[inodeIdx].inode = inodeIdx;
   }
 
   // Set the rwptr to be the size (assume no empty space in middle, rwptr <= size always)
-  fd_table[inodeIdx].rwptr = inode_table[inodeIdx].size;
+  fs->fd_table[inodeIdx].rwptr = fs->inode_table[inodeIdx].size;
+  fs->fd_table[inodeIdx].ra_next = fs->fd_table[inodeIdx].rwptr;
+  fs->fd_table[inodeIdx].ra_window = 0;
+  fs->fd_table[inodeIdx].ra_end = 0;
 
-  // The inode table and root directory were modified, so write these to disk
-  write_blocks(1, NUM_INODE_BLOCKS, inode_table);
-  write_blocks(1+NUM_INODES, NUM_ROOTDIR_BLOCKS, root_directory);
+  // Only a new file changed the inode table and root directory
+  // Opening an existing one writes nothing
+  write_metadata(fs);
 
 
   if (DEBUG==1) printf("Returning FD %d \n", inodeIdx);
 	return inodeIdx;
 }
 
-int sfs_fclose(int fileID){
+int sfs_close(sfs_t *fs, int fileID){
   // Closes a file
   // Removes the entry from the open file descriptor table
 
 
   // If there is no fd_table entry for the given ID then either closed
   // Or the entry otherwise doesn't exist
-  if (fd_table[fileID].inode == 0){
+  if (fs->fd_table[fileID].inode == 0){
     if (DEBUG==1) printf("No such file descriptor entry at index %d \n", fileID);
     return -1;
   }
 
+  // Blocks held back get allocated now, what is left of the reservation
+  // goes back to the free pool. Ones that still cannot be written are lost
+  flush_delayed(fs, fileID);
+  fs->delayed_blocks -= fs->fd_table[fileID].da_count;
+  fs->fd_table[fileID].da_count = 0;
+  free(fs->fd_table[fileID].da_buf);
+  fs->fd_table[fileID].da_buf = NULL;
+  release_reservation(fs, fileID);
+  fs->resv[fileID].size = 0;
+
   // If the entry does exist, reset both of the fields in the fd_table
   // Return 0 for success
-  fd_table[fileID].inode = 0;
-  fd_table[fileID].rwptr = 0;
+  fs->fd_table[fileID].inode = 0;
+  fs->fd_table[fileID].rwptr = 0;
+  invalidate_block_map(fs, fileID);
 
 	return 0;
 }
 
-int get_RW_block(int fileID, int write){
-  // This function gets the block index from the rwpointer information (fileID)
+int map_block(sfs_t *fs, int fileID, int logical, extent_t *found){
+  // Finds the extent holding block logical of the file, trying the one the
+  // open file used last before the extent map. Returns 0 if not mapped
+  file_descriptor* fd = &fs->fd_table[fileID];
+  extent_t* last = &fd->map_extent;
+
+  if (last->length > 0 && logical >= last->logical && logical < last->logical + last->length){
+    *found = *last;
+    return 1;
+  }
+  if (!extent_lookup(fs, fileID, logical, found)) return 0;
+  if (fd->inode != 0) *last = *found;
+  return 1;
+}
+
+int block_goal(sfs_t *fs, int fileID, int logical){
+  // Where block logical of the file had best go: right after the block
+  // before it, or for a first block wherever the group of the inode is at
+  extent_t found;
+  if (logical > 0 && map_block(fs, fileID, logical - 1, &found)) return found.start + (logical - found.logical);
+  return fs->groups[INODE_GROUP(fs, fileID)].hint;
+}
+
+int get_RW_block(sfs_t *fs, int fileID, int rwOffset, int write, int *run){
+  // This function gets the block index holding byte rwOffset of the file (fileID)
+  // run, if not NULL, gets how many blocks from there on are physically consecutive
   // If the write flag is on then we are in write mode, (write == 1)
   //    Write mode will also allocate the blocks
 
-  // fd and inode use same index, need both of them
-  file_descriptor* fd = &fd_table[fileID];
-  inode_t* inode = &inode_table[fileID];
+  // fd and inode use same index
+  int blockOffset = rwOffset / fs->block_size;
+  extent_t found;
 
-  // Get the current file location to write to based on the rwptr
-  int rwOffset = fd->rwptr;
-  
-  // Get the current block pointed to by the RW pointer
-  int blockOffset = rwOffset / BLOCK_SIZE;
-
-  // Get the location of the current block to be written
-  int curDataPageIdx = 0;
-  
-  // If the blockOffset < 12 then the rwOffset points to a direct pointer block
-  if (blockOffset < 12){
-    if (DEBUG==1) printf("Acquiring data page from direct ptr #%d \n", blockOffset);
-
-    // If it is a direct pointer then the corresponding block can be read directly
-    curDataPageIdx = inode->data_ptrs[blockOffset]; 
-
-    // If the index is 0 then it is empty
-    // Create a page and point to it if write
-    if (curDataPageIdx == 0){
-      if (write == 1){
-        curDataPageIdx = get_next_free_block();
-        inode->data_ptrs[blockOffset] = curDataPageIdx;
-        return curDataPageIdx;
-      }
+  if (map_block(fs, fileID, blockOffset, &found)){
+    if (run != NULL) *run = found.length - (blockOffset - found.logical);
+    return found.start + (blockOffset - found.logical);
+  }
 
-      // If trying to read from empty then we have a problem
-      if (DEBUG==1) printf("Attempting to read from uninst dir ptr #%d \n", blockOffset);
-      return -1;
-    }
+  // If trying to read from empty then we have a problem
+  if (write != 1){
+    if (DEBUG==1) printf("Attempting to read unmapped block %d of inode #%d \n", blockOffset, fileID);
+    return -1;
+  }
 
-    return curDataPageIdx;
-  }
-  else{
-    // Reading from indirect pointers
-
-    if (DEBUG==1) printf("Acquiring data page from indirect pointers \n");
-    // Indirect pointers
-    // The indirect pointer will be the block index of the pointerPage
-    // This block will be filled with contiguous pointers to data pages
-    int indirPtr = inode->indirect_ptr;
-    char *pointerPage = calloc(1,BLOCK_SIZE);
-    
-    // If the indirect ptr hasn't been set up yet
-    // Need to create a pointer page
-    // The farthest an RW pointer will be is pointing to this first page
-    // Probably has a block offset of 12
-    if (indirPtr <=0){
-      if (write == 1){
-        if (DEBUG==1) printf("No indirect found, creating new indirect for inode %d \n", fileID);
-
-        // get the next free block and set the indirect pointer to be this location
-        indirPtr = get_next_free_block();
-        inode->indirect_ptr = indirPtr;
-
-        // set up a data page as well
-        // If a data page can be set up then write it to disk
-        curDataPageIdx = get_next_free_block();
-        if (curDataPageIdx != -1){
-          // set the first index in the pointer page to be the current data page index
-          pointerPage[0] = curDataPageIdx;
-
-          // Write out the pointer page
-          write_blocks(indirPtr, 1, pointerPage);
-          if (DEBUG==1) printf("New indirect created at %d \n", curDataPageIdx);
-        }
+  // Allocate the block, right after the one before it if possible
+  // so that the extent simply grows
+  int curDataPageIdx = alloc_file_block(fs, fileID, block_goal(fs, fileID, blockOffset));
+  if (curDataPageIdx == -1) return -1;
+  if (extent_insert(fs, fileID, (extent_t){ blockOffset, curDataPageIdx, 1, 0 }) == -1){
+    free_block_at(fs, curDataPageIdx);
+    return -1;
+  }
 
-        return curDataPageIdx;
-      }
-      // if trying to read from empty then we have a problem
-      if (DEBUG==1) printf("Attempting to read from uninst indir ptr for inode #%d \n", fileID);
-      return -1;
-    }
-    else{
-      // Get the indirect ptr
-      // Read the ptr page from ptr
-      // get the index - 12 th page from the ptr page
-      // If write and no index-12 then get a new block and link this page to that
-      // else return the index-12
-      // TODO TODO TODO why does this work?
-      int *pointerPage = calloc(1,BLOCK_SIZE);
-      read_blocks(indirPtr, 1, (void*) pointerPage);
-      
-      // we know that the block offset is at least 12
-      // now have to find the offset on the pointer page
-      // todo i think this is causing issues from writing currupted data from disk
-      blockOffset -= 12;
-      curDataPageIdx = pointerPage[blockOffset];
-      if (DEBUG==1) printf("Indirect pointer found at index block %d, ptr slot %d \n", indirPtr, blockOffset);
-
-      // if i iterates all the way to block size, then the pointer page is full
-      // cannot allocate any memory so quit
-      if (blockOffset >= BLOCK_SIZE/PTR_SIZE){
-        if (DEBUG==1) printf("Inode is full on inode #%d \n", fileID);
-        return -1;
-      }
+  if (run != NULL) *run = 1;
+  return curDataPageIdx;
+}
 
-      // If the data page does not exist and there is a write, then create it
-      if (curDataPageIdx == 0){
-        if (write == 1){
-          // Get the next free block
-          // Set the proper pointer on the idirect page
-          // Write the indirect page back to disk
-          curDataPageIdx = get_next_free_block();
-          if (curDataPageIdx != -1){
-            if (DEBUG==1) printf("Create new pointer slot for page %d  \n", curDataPageIdx);
-            pointerPage[blockOffset] = curDataPageIdx;
-            write_blocks(indirPtr, 1, pointerPage);
-          }
-          return curDataPageIdx;
-        }
-        // If trying to read from empty then we have a problem
-        if (DEBUG==1) printf("Attempting to read from uninst indir ptr for inode #%d \n", fileID);
-        return -1;
-      }
+int mark_written(sfs_t *fs, int fileID, int logical, int n){
+  // Blocks logical up to logical+n of the file were just written, those
+  // allocated ahead by sfs_allocate stop reading as zeros
+  // Returns 0, or -1 if the extent map could not record it
+  extent_t found;
+  while (n > 0){
+    if (!map_block(fs, fileID, logical, &found)) return -1;
+    int k = found.logical + found.length - logical;
+    if (k > n) k = n;
+    if (found.unwritten && extent_written(fs, fileID, found, logical, k) == -1) return -1;
+    logical += k;
+    n -= k;
+  }
+  return 0;
+}
+
+//////////////////// INLINE DATA ////////////////////
+// With JITS_INLINE_DATA a new file keeps its bytes in data[] of its inode,
+// which is read and written in the inode table in memory without any data
+// block. A file outgrowing it moves them to its first block
+
+// Moves the bytes of an inline file to its first block, the file is
+// mapped by extents from then on. Returns 0, or -1 without a free block
+int inline_to_blocks(sfs_t *fs, int fileID){
+  inode_t* inode = &fs->inode_table[fileID];
+
+  if (inode->size > 0){
+    int curDataPageIdx = get_RW_block(fs, fileID, 0, 1, NULL);
+    if (curDataPageIdx == -1) return -1;
+    char* block = cache_get(fs->cache, curDataPageIdx, CACHE_NOREAD);
+    if (block == NULL) return -1;
+    memset(block, 0, fs->block_size);
+    memcpy(block, inode->data, inode->size);
+    cache_put(fs->cache, curDataPageIdx, 1);
+  }
 
-      return curDataPageIdx;
+  if (DEBUG==1) printf("Inode %d outgrew its inline data \n", fileID);
+  inode->inline_data = 0;
+  memset(inode->data, 0, INODE_INLINE);
+  mark_inode_dirty(fs, fileID);
+  return 0;
+}
+
+//////////////////// DELAYED ALLOCATION ////////////////////
+// With JITS_DELAYED_ALLOC, blocks appended to a file wait in its descriptor
+// (up to DELAYED_BLOCKS of them) without a place on disk. When the file is
+// flushed (read, closed, synced, or the buffer is full) they all get one
+// reservation and go out as one write
+
+// Copies the part of data that goes into the block at the rwptr to the held
+// back blocks. Returns the number of bytes taken, 0 if the block cannot be
+// held back (it is on disk, or does not continue the held back ones)
+int delay_write(sfs_t *fs, int fileID, const char *data, int length){
+  file_descriptor* fd = &fs->fd_table[fileID];
+  int blockOffset = fd->rwptr / fs->block_size;
+  int fileOffset = fd->rwptr % fs->block_size;
+  extent_t found;
+
+  if (fd->da_count > 0 && (blockOffset < fd->da_first || blockOffset > fd->da_first + fd->da_count)) return 0;
+  if (fd->da_count > 0 && blockOffset - fd->da_first >= DELAYED_BLOCKS) return 0;
+  if ((fd->da_count == 0 || blockOffset == fd->da_first + fd->da_count) && map_block(fs, fileID, blockOffset, &found)) return 0;
+
+  // Every held back block must be sure to find a place later
+  if (blockOffset == fd->da_first + fd->da_count || fd->da_count == 0){
+    int avail = fs->free_blocks;
+    for (int n = 0; n < fs->resv_count; n++) avail += fs->resv[fs->resv_list[n]].end - fs->resv[fs->resv_list[n]].next;
+    if (fs->delayed_blocks >= avail) return 0;
+  }
+
+  if (fd->da_buf == NULL){
+    fd->da_buf = malloc(DELAYED_BLOCKS * fs->block_size);
+    if (fd->da_buf == NULL) return 0;
+  }
+  if (fd->da_count == 0) fd->da_first = blockOffset;
+
+  // A block new to the buffer starts zeroed
+  char* block = fd->da_buf + (blockOffset - fd->da_first) * fs->block_size;
+  if (blockOffset == fd->da_first + fd->da_count){
+    memset(block, 0, fs->block_size);
+    fd->da_count++;
+    fs->delayed_blocks++;
+  }
+
+  int numCharsToCopy = fs->block_size - fileOffset;
+  if (length < numCharsToCopy) numCharsToCopy = length;
+  memcpy(block + fileOffset, data, numCharsToCopy);
+  return numCharsToCopy;
+}
 
+// Allocates the held back blocks of a file and writes them
+// Returns 0, or -1 if some could not be written. Those stay held back from
+// the first one that failed on, so that the next flush tries them again
+int flush_delayed(sfs_t *fs, int fileID){
+  file_descriptor* fd = &fs->fd_table[fileID];
+  if (fd->da_count == 0) return 0;
+  fs->delayed_blocks -= fd->da_count;
+
+  // Make the reservation big enough for all of them, after the block before
+  if (fs->resv[fileID].end - fs->resv[fileID].next < fd->da_count){
+    release_reservation(fs, fileID);
+    reserve_window(fs, fileID, block_goal(fs, fileID, fd->da_first), fd->da_count);
+  }
+
+  int ret = 0;
+  int i = 0;
+  while (i < fd->da_count && ret == 0){
+    int curDataPageIdx = get_RW_block(fs, fileID, (fd->da_first + i) * fs->block_size, 1, NULL);
+    if (curDataPageIdx == -1){
+      ret = -1;
+      break;
     }
 
-    return curDataPageIdx;
+    // Gather the blocks that landed right after it
+    int n = 1;
+    while (i + n < fd->da_count){
+      int next = get_RW_block(fs, fileID, (fd->da_first + i + n) * fs->block_size, 1, NULL);
+      if (next == -1) ret = -1;
+      if (next != curDataPageIdx + n) break;
+      n++;
+    }
+
+    if (cache_write_direct(fs->cache, curDataPageIdx, n, fd->da_buf + i * fs->block_size) < 0){
+      ret = -1;
+      break;
+    }
+    i += n;
   }
 
+  if (ret == -1 && DEBUG==1) printf("Could not write held back blocks of inode %d \n", fileID);
+  memmove(fd->da_buf, fd->da_buf + i * fs->block_size, (fd->da_count - i) * fs->block_size);
+  fd->da_first += i;
+  fd->da_count -= i;
+  fs->delayed_blocks += fd->da_count;
+  write_metadata(fs);
+  return ret;
+}
 
+void read_ahead(sfs_t *fs, int fileID, int length){
+  // Called before reading length bytes at the rwptr. A sequential read
+  // (continuing the previous one, or starting the file) grows the window,
+  // anything else collapses it. Once the reads come within half a window
+  // of what was read ahead, the next window is brought into the cache
+  file_descriptor* fd = &fs->fd_table[fileID];
+  inode_t* inode = &fs->inode_table[fd->inode];
+
+  if (fd->rwptr != fd->ra_next && fd->rwptr != 0){
+    fd->ra_window = 0;
+    fd->ra_end = 0;
+    fd->ra_next = fd->rwptr + length;
+    return;
+  }
+  fd->ra_next = fd->rwptr + length;
+
+  int lastBlock = (fd->rwptr + length - 1) / fs->block_size;
+  if (fd->ra_window > 0 && lastBlock + fd->ra_window/2 < fd->ra_end) return;
+
+  if (fd->ra_window == 0) fd->ra_window = READAHEAD_MIN;
+  else if (fd->ra_window < READAHEAD_MAX) fd->ra_window *= 2;
+  if (fd->ra_window > READAHEAD_MAX) fd->ra_window = READAHEAD_MAX;
+
+  // Never past the end of the file
+  int start = lastBlock + 1;
+  if (start < fd->ra_end) start = fd->ra_end;
+  int end = lastBlock + 1 + fd->ra_window;
+  int fileBlocks = inode->size / fs->block_size + (inode->size % fs->block_size != 0);
+  if (end > fileBlocks) end = fileBlocks;
+  if (start >= end) return;
+
+  // Holes and unwritten blocks have nothing on disk to read
+  int blocks[READAHEAD_MAX];
+  int n = 0;
+  extent_t found;
+  for (int i = start; i < end; i++){
+    if (!map_block(fs, fileID, i, &found) || found.unwritten) continue;
+    blocks[n++] = found.start + (i - found.logical);
+  }
 
+  // Physically consecutive blocks are read with one request
+  cache_prefetch(fs->cache, blocks, n);
+  fd->ra_end = end;
 }
 
-int sfs_fread(int fileID, char *buf, int length){
+int sfs_read(sfs_t *fs, int fileID, char *buf, int length){
   // Want to read from the given fileID at the current offset
-  
+
   // First, get the FD and inodes corresponding to the fileID
-  file_descriptor* fd = &fd_table[fileID];
-  inode_t* inode = &inode_table[fd->inode];
+  file_descriptor* fd = &fs->fd_table[fileID];
+  inode_t* inode = &fs->inode_table[fd->inode];
 
   // If the fd's inode is 0 then the fd entry is empty
   if (fd->inode == 0){
@@ -616,93 +1872,96 @@ int sfs_fread(int fileID, char *buf, int length){
     return 0;
   }
 
-  
-
   // Get the current file location to write to based on the rwptr
-  int rwOffset = fd->rwptr;
-  if (DEBUG==1) printf("RW offset %d \n", rwOffset);
-  
+  if (DEBUG==1) printf("RW offset %d \n", fd->rwptr);
+
+  // Never read past the end of the file
+  if (length > inode->size - fd->rwptr) length = inode->size - fd->rwptr;
+  if (length <= 0) return 0;
 
-  // fileOffset is the byte location within the current block
-  // Also get the block to be read to from the current RW pointer location
-  int fileOffset = rwOffset % BLOCK_SIZE;
-  int curDataPageIdx = get_RW_block(fileID, 0);
-  
+  // A small file is read straight from its inode
+  if (inode->inline_data){
+    memcpy(buf, inode->data + fd->rwptr, length);
+    fd->rwptr += length;
+    return length;
+  }
+
+  // Held back blocks have to be on disk to be read
+  if (flush_delayed(fs, fileID) == -1) return 0;
+
+  read_ahead(fs, fileID, length);
 
   int bufferIdx = 0;
   while(bufferIdx < length){
-    // Error checking, if curDataBlockIdx == -1 then out of bounds
+    // fileOffset is the byte location within the current block
+    int fileOffset = fd->rwptr % fs->block_size;
+
+    // The block and how many physically consecutive ones follow it
+    // A hole reads as zeros up to the next extent, so do blocks allocated
+    // ahead and never written, neither touches the disk
+    extent_t found;
+    int blockOffset = fd->rwptr / fs->block_size;
+    int run;
+    int curDataPageIdx = -1;
+    if (map_block(fs, fileID, blockOffset, &found)){
+      run = found.length - (blockOffset - found.logical);
+      if (!found.unwritten) curDataPageIdx = found.start + (blockOffset - found.logical);
+    }
+    else if (extent_next(fs, fileID, blockOffset, &found)) run = found.logical - blockOffset;
+    else run = ((long long)length - bufferIdx + fileOffset + fs->block_size - 1) / fs->block_size;
+
     if (curDataPageIdx == -1){
-      if (DEBUG==1) printf("Read out of bounds \n");
-      return 0;
+      // A hole can run on past INT_MAX bytes from the start of the file
+      long long numCharsToZero = (long long)run*fs->block_size - fileOffset;
+      if ((length-bufferIdx) < numCharsToZero) numCharsToZero = length-bufferIdx;
+      memset(buf + bufferIdx, 0, numCharsToZero);
+      fd->rwptr += numCharsToZero;
+      bufferIdx += numCharsToZero;
+      continue;
     }
 
-    char *dataBuf = calloc(1,BLOCK_SIZE);
-    read_blocks(curDataPageIdx, 1, (void*) dataBuf);
+    // Whole blocks land straight in the buffer, a run of them with a single read
+    int whole = fileOffset == 0 ? (length - bufferIdx) / fs->block_size : 0;
+    if (whole > run) whole = run;
+    if (whole > 0){
+      if (DEBUG==1) printf("Reading %d whole blocks from block %d \n", whole, curDataPageIdx);
+      if (cache_read_direct(fs->cache, curDataPageIdx, whole, buf + bufferIdx) < 0){
+        if (DEBUG==1) printf("Read failed \n");
+        return bufferIdx;
+      }
+      fd->rwptr += whole*fs->block_size;
+      bufferIdx += whole*fs->block_size;
+      continue;
+    }
 
+    // A partial first or last block goes through the cache
+    char* dataBuf = cache_get(fs->cache, curDataPageIdx, 0);
+    if (dataBuf == NULL){
+      if (DEBUG==1) printf("Read failed \n");
+      return bufferIdx;
+    }
 
     // Set the number of characters to copy within the block
-    int numCharsToCopy = (BLOCK_SIZE-fileOffset);  
+    int numCharsToCopy = (fs->block_size-fileOffset);
     if ((length-bufferIdx) < numCharsToCopy) numCharsToCopy = length-bufferIdx;
-    if ((inode->size - fd->rwptr) < numCharsToCopy) numCharsToCopy = inode->size - fd->rwptr;
-
-    if (numCharsToCopy == 0) break;
 
     if (DEBUG==1) printf("Reading %d of %d bytes from block %d \n", numCharsToCopy, length, curDataPageIdx);
 
     // copy the page into the buffer
     memcpy(buf + bufferIdx, dataBuf + fileOffset, numCharsToCopy);
 
-    // write the blocks to memory
-    //write_blocks(curDataPageIdx, 1, (void*) dataBuf);
-    write_blocks(curDataPageIdx, 1, dataBuf);
-
-    // Free the source buffer
-    free(dataBuf);
-
-    // Update rwptr, the file size, and the current buffer idx
-    // If the rwptr has a larger offset than the inode size then size increases
-    // Assume optimal file writing
+    // Update rwptr and the current buffer idx
     fd->rwptr += numCharsToCopy;
     bufferIdx += numCharsToCopy;
-    fileOffset = 0;
 
-    // Double check and grab next chars
-    if (bufferIdx < length) curDataPageIdx = get_RW_block(fileID, 0);
-
-
-    /*
-    // Read the whole block from memory... cannot read a partial block
-    char *tempBlock = calloc(1,BLOCK_SIZE);
-    read_blocks(curDataBlockIdx, 1, (void*) tempBlock);
-
-    // Iterate over the block starting at the file offset
-    // Copy one byte at a time into the buffer
-    for (fileOffset = fileOffset; fileOffset < BLOCK_SIZE && bufferIdx < length; fileOffset ++){
-      buf[bufferIdx] = tempBlock[fileOffset];
-      
-      // Advance the rwptr and the buffer
-      bufferIdx ++;
-      fd->rwptr ++; 
-    }
-
-    // Set fileOffset to 0 if filled
-    fileOffset = 0;
-
-
-    // Get new data block
-    curDataBlockIdx = get_RW_block(fileID, 0);
-
-*/
+    // Reading leaves the block clean
+    cache_put(fs->cache, curDataPageIdx, 0);
   }
 
-
-
-  
 	return bufferIdx;
 }
 
-int sfs_fwrite(int fileID, const char *buf, int length){
+int sfs_write(sfs_t *fs, int fileID, const char *buf, int length){
   // Writes the given number of bytes of buffered data in buf to the open file
   //    Start write at current file pointer
   // Will increase the size of a file by the given number of bytes
@@ -714,7 +1973,7 @@ int sfs_fwrite(int fileID, const char *buf, int length){
   //    Modify the file's i-Node to point to these blocks
   //    Write the data the user gives to these blocks
   //    Flush all modifications to disk
-  // NOTE: All writes to disk are at block sizes. 
+  // NOTE: All writes to disk are at block sizes.
   //    If you are writing a few blocks to a file, might end up writing a block to next
   //    Important to read the last block and set the write pointer to the EOF
   //    Bytes you want to write go to end of previous bytes already part of file
@@ -722,42 +1981,121 @@ int sfs_fwrite(int fileID, const char *buf, int length){
 
 
   // Grab both file descriptor entry and the inode
-  file_descriptor* fd = &fd_table[fileID];
-  inode_t* inode = &inode_table[fd->inode];
+  file_descriptor* fd = &fs->fd_table[fileID];
+  inode_t* inode = &fs->inode_table[fd->inode];
 
   // If the fd's inode is 0 then the fd entry is empty
   if (fd->inode == 0){
     if (DEBUG==1) printf("FD table slot %d is empty \n", fd->inode);
     return -1;
   }
-  
-  // Get the block that we are going to write to
-  int curDataPageIdx = get_RW_block(fileID, 1);
-  if (DEBUG==1) printf("Block to write file to is %d \n", curDataPageIdx);  
 
   // Get the current file location to write to based on the rwptr
-  int rwOffset = fd->rwptr;
-  if (DEBUG==1) printf("RW offset %d \n", rwOffset);
+  if (DEBUG==1) printf("RW offset %d \n", fd->rwptr);
+
+  // Sizes and offsets are ints, a file ends at INT_MAX bytes (2 GiB)
+  // A write going past that is cut short, one starting there fails
+  if (length > 0 && fd->rwptr == INT_MAX){
+    if (DEBUG==1) printf("File %d is at its largest size \n", fileID);
+    return -1;
+  }
+  if (length > INT_MAX - fd->rwptr) length = INT_MAX - fd->rwptr;
+
+  // A small file is written into its inode, one that outgrows it moves
+  // to a block first
+  if (inode->inline_data && length > 0){
+    if (fd->rwptr <= INODE_INLINE && length <= INODE_INLINE - fd->rwptr){
+      memcpy(inode->data + fd->rwptr, buf, length);
+      fd->rwptr += length;
+      if (fd->rwptr > inode->size) inode->size = fd->rwptr;
+      mark_inode_dirty(fs, fd->inode);
+      write_metadata(fs);
+      return length;
+    }
+    if (inline_to_blocks(fs, fd->inode) == -1){
+      if (DEBUG==1) printf("Could not write \n");
+      write_metadata(fs);
+      return 0;
+    }
+  }
 
-  // fileOffset is the byte location within the current block
-  int fileOffset = rwOffset % BLOCK_SIZE;
   // This is the location within the buffer (how far through the data we are)
   int bufferIdx = 0;
 
   while (bufferIdx < length){
+    // fileOffset is the byte location within the current block
+    int fileOffset = fd->rwptr % fs->block_size;
+
+    // Appended blocks can be held back, a full buffer is flushed first
+    if (JITS_DELAYED_ALLOC){
+      int numCharsHeld = delay_write(fs, fileID, buf + bufferIdx, length - bufferIdx);
+      if (numCharsHeld == 0 && fd->da_count > 0){
+        flush_delayed(fs, fileID);
+        numCharsHeld = delay_write(fs, fileID, buf + bufferIdx, length - bufferIdx);
+      }
+      if (numCharsHeld > 0){
+        fd->rwptr += numCharsHeld;
+        if (fd->rwptr > inode->size){
+          inode->size = fd->rwptr;
+          mark_inode_dirty(fs, fd->inode);
+        }
+        bufferIdx += numCharsHeld;
+        continue;
+      }
+    }
+
+    // A block that was a hole or never written has nothing on disk worth reading
+    extent_t found;
+    int fresh = !map_block(fs, fileID, fd->rwptr / fs->block_size, &found) || found.unwritten;
+
+    // Get the block that we are going to write to, allocating as needed
+    int run;
+    int curDataPageIdx = get_RW_block(fs, fileID, fd->rwptr, 1, &run);
+    if (DEBUG==1) printf("Block to write file to is %d \n", curDataPageIdx);
     if (curDataPageIdx == -1){
       if (DEBUG==1) printf("Could not write \n");
       break;
     }
 
-    if (DEBUG==1) printf("\n\n");
-    // read block from current page
-    char *dataBuf = calloc(BLOCK_SIZE,1);
-    read_blocks(curDataPageIdx, 1, (void*) dataBuf);
+    // Whole blocks are replaced without reading them. The ones following
+    // right after on disk, already there or allocated there now, go with
+    // the same write
+    int whole = fileOffset == 0 ? (length - bufferIdx) / fs->block_size : 0;
+    if (whole > 0){
+      int n = 1;
+      while (n < whole){
+        if (n >= run){
+          int nextRun;
+          int next = get_RW_block(fs, fileID, fd->rwptr + n*fs->block_size, 1, &nextRun);
+          if (next != curDataPageIdx + n) break;
+          run = n + nextRun;
+        }
+        n++;
+      }
+
+      if (DEBUG==1) printf("Writing %d whole blocks to block %d \n", n, curDataPageIdx);
+      if (cache_write_direct(fs->cache, curDataPageIdx, n, buf + bufferIdx) < 0 || mark_written(fs, fileID, fd->rwptr / fs->block_size, n) == -1){
+        if (DEBUG==1) printf("Could not write \n");
+        break;
+      }
+      fd->rwptr += n*fs->block_size;
+      bufferIdx += n*fs->block_size;
+      if (fd->rwptr > inode->size){
+        inode->size = fd->rwptr;
+        mark_inode_dirty(fs, fd->inode);
+      }
+      continue;
+    }
 
+    // A partial block is patched in the cache, a fresh one starts zeroed
+    char* dataBuf = cache_get(fs->cache, curDataPageIdx, fresh ? CACHE_NOREAD : 0);
+    if (dataBuf == NULL){
+      if (DEBUG==1) printf("Could not write \n");
+      break;
+    }
 
     // Set the number of characters to copy within the block
-    int numCharsToCopy = (BLOCK_SIZE-fileOffset);  
+    int numCharsToCopy = (fs->block_size-fileOffset);
     if ((length-bufferIdx) < numCharsToCopy) numCharsToCopy = length-bufferIdx;
 
     if (DEBUG==1) printf("Writing %d of %d bytes to block %d \n", numCharsToCopy, length, curDataPageIdx);
@@ -765,36 +2103,31 @@ int sfs_fwrite(int fileID, const char *buf, int length){
     // copy the page into the buffer
     memcpy(dataBuf + fileOffset, buf + bufferIdx, numCharsToCopy);
 
-    // NOTE getting correct output here... not writing to disk properly though
-    //for (int i = 0; i < BLOCK_SIZE; i++){
-    //  printf("%c", &dataBuf[i]);
-    //}
-    //printf("\n\n");
-
-    // write the blocks to memory
-    //write_blocks(curDataPageIdx, 1, (void*) dataBuf);
-    write_blocks(curDataPageIdx, 1, dataBuf);
-
-    // Free the source buffer
-    free(dataBuf);
+    // write the blocks to memory (the cache writes them back later)
+    cache_put(fs->cache, curDataPageIdx, 1);
+    if (mark_written(fs, fileID, fd->rwptr / fs->block_size, 1) == -1){
+      if (DEBUG==1) printf("Could not write \n");
+      break;
+    }
 
     // Update rwptr, the file size, and the current buffer idx
     // If the rwptr has a larger offset than the inode size then size increases
     // Assume optimal file writing
     fd->rwptr += numCharsToCopy;
-    if (fd->rwptr > inode->size) inode->size = fd->rwptr;
+    if (fd->rwptr > inode->size){
+      inode->size = fd->rwptr;
+      mark_inode_dirty(fs, fd->inode);
+    }
     bufferIdx += numCharsToCopy;
-    fileOffset = 0;
-
-    // Double check and grab next chars
-    if (bufferIdx < length) curDataPageIdx = get_RW_block(fileID, 1);
   }
 
+  // The inode changed if the file grew or got new blocks
+  write_metadata(fs);
 
 	return bufferIdx;
 }
 
-int sfs_fseek(int fileID, int loc){
+int sfs_seek(sfs_t *fs, int fileID, int loc){
   // Moves the r/w pointer to the given location (nothing to be done on disk)
   //
   // "interesting problem is performing a read or write after moving r/w ptr"
@@ -802,7 +2135,7 @@ int sfs_fseek(int fileID, int loc){
   // Could implement with two ptrs?
 
   // Grab the file descriptor entry
-  file_descriptor* fd = &fd_table[fileID];
+  file_descriptor* fd = &fs->fd_table[fileID];
 
   // If the fd's inode is 0 then the fd entry is empty
   if (fd->inode == 0){
@@ -815,72 +2148,297 @@ int sfs_fseek(int fileID, int loc){
     return -1;
   }
 
-  fd_table[fileID].rwptr = loc;
+  fs->fd_table[fileID].rwptr = loc;
 
 	return 0;
 }
 
-int sfs_remove(char *file) {
+int sfs_seek_data(sfs_t *fs, int fileID, int loc){
+  // Moves the r/w pointer to the first byte at or after loc that is not in
+  // a hole (like lseek with SEEK_DATA). Unwritten blocks count as a hole
+  // Returns the new location, or -1 if there is no data from loc on
+  file_descriptor* fd = &fs->fd_table[fileID];
+  inode_t* inode = &fs->inode_table[fd->inode];
+
+  // If the fd's inode is 0 then the fd entry is empty
+  if (fd->inode == 0){
+    if (DEBUG==1) printf("FD table slot %d is empty \n", fileID);
+    return -1;
+  }
+  if (loc < 0 || loc >= inode->size) return -1;
+
+  // An inline file is data all through
+  if (inode->inline_data){
+    fd->rwptr = loc;
+    return loc;
+  }
+
+  // Held back blocks are data too, they have to be in the map
+  if (flush_delayed(fs, fileID) == -1) return -1;
+
+  extent_t found;
+  int logical = loc / fs->block_size;
+  while (extent_next(fs, fileID, logical, &found)){
+    if (found.unwritten){
+      logical = found.logical + found.length;
+      continue;
+    }
+    if (found.logical * fs->block_size > loc) loc = found.logical * fs->block_size;
+    if (loc >= inode->size) return -1;
+    fd->rwptr = loc;
+    return loc;
+  }
+  return -1;
+}
+
+int sfs_seek_hole(sfs_t *fs, int fileID, int loc){
+  // Moves the r/w pointer to the first byte at or after loc that is in a
+  // hole (like lseek with SEEK_HOLE), the end of the file counts as one
+  // Returns the new location, or -1 if loc is past the end of the file
+  file_descriptor* fd = &fs->fd_table[fileID];
+  inode_t* inode = &fs->inode_table[fd->inode];
+
+  // If the fd's inode is 0 then the fd entry is empty
+  if (fd->inode == 0){
+    if (DEBUG==1) printf("FD table slot %d is empty \n", fileID);
+    return -1;
+  }
+  if (loc < 0 || loc >= inode->size) return -1;
+
+  // An inline file is data all through
+  if (inode->inline_data){
+    fd->rwptr = inode->size;
+    return inode->size;
+  }
+
+  // Held back blocks are data too, they have to be in the map
+  if (flush_delayed(fs, fileID) == -1) return -1;
+
+  // Skip the written extents that follow each other from loc on
+  extent_t found;
+  int logical = loc / fs->block_size;
+  while (extent_next(fs, fileID, logical, &found) && found.logical <= logical && !found.unwritten){
+    logical = found.logical + found.length;
+  }
+  // The last block of a file near INT_MAX bytes ends past INT_MAX
+  long long end = (long long)logical * fs->block_size;
+  if (end > inode->size) end = inode->size;
+  if (end > loc) loc = end;
+  fd->rwptr = loc;
+  return loc;
+}
+
+int sfs_allocate(sfs_t *fs, int fileID, int offset, int length){
+  // Gives bytes offset up to offset+length of the file their blocks ahead
+  // of the writes, in as few runs of contiguous blocks as the free space
+  // allows. They stay unwritten, reading them gives zeros without touching
+  // the disk, until they are written. The file grows to offset+length if
+  // it is shorter, the rwptr does not move
+  file_descriptor* fd = &fs->fd_table[fileID];
+  inode_t* inode = &fs->inode_table[fd->inode];
+
+  // If the fd's inode is 0 then the fd entry is empty
+  if (fd->inode == 0){
+    if (DEBUG==1) printf("FD table slot %d is empty \n", fileID);
+    return -1;
+  }
+  if (offset < 0 || length <= 0 || length > INT_MAX - offset) return -1;
+
+  // An inline file already has room for INODE_INLINE bytes
+  if (inode->inline_data && offset + length <= INODE_INLINE){
+    if (offset + length > inode->size){
+      inode->size = offset + length;
+      mark_inode_dirty(fs, fileID);
+      write_metadata(fs);
+    }
+    return 0;
+  }
+  if (inode->inline_data && inline_to_blocks(fs, fileID) == -1){
+    write_metadata(fs);
+    return -1;
+  }
+
+  // Held back blocks are not in the map yet, what is left of the
+  // reservation may be part of a better run
+  if (flush_delayed(fs, fileID) == -1) return -1;
+  release_reservation(fs, fileID);
+
+  // Blocks between the end of the file and offset stay a hole
+  int logical = offset / fs->block_size;
+  int end = (offset + length - 1) / fs->block_size + 1;
+  int ret = 0;
+
+  while (logical < end){
+    // Mapped blocks are skipped, the ones up to the next extent are allocated together
+    extent_t found;
+    int want = end - logical;
+    if (extent_next(fs, fileID, logical, &found)){
+      if (found.logical <= logical){
+        logical = found.logical + found.length;
+        continue;
+      }
+      if (found.logical - logical < want) want = found.logical - logical;
+    }
+
+    int got;
+    int start = get_free_run(fs, block_goal(fs, fileID, logical), want, &got);
+    if (start == -1){
+      // The volume is full, except maybe for what other files reserved
+      release_all_reservations(fs);
+      start = get_free_run(fs, block_goal(fs, fileID, logical), want, &got);
+    }
+    if (start == -1){
+      ret = -1;
+      break;
+    }
+    if (extent_insert(fs, fileID, (extent_t){ logical, start, got, 1 }) == -1){
+      for (int b = start; b < start + got; b++) free_block_at(fs, b);
+      ret = -1;
+      break;
+    }
+    logical += got;
+  }
+
+  if (ret == 0 && offset + length > inode->size){
+    inode->size = offset + length;
+    mark_inode_dirty(fs, fileID);
+  }
+  write_metadata(fs);
+  return ret;
+}
+
+int sfs_unlink(sfs_t *fs, char *file) {
   // Removes the file from the directory entry
-  // Releases the file allocation entries 
-  // Releases the data blocks used by the file 
+  // Releases the file allocation entries
+  // Releases the data blocks used by the file
   //    So they can be used by new files in the future
 
   if (DEBUG==1) printf("Removing file %s \n", file);
 
   // Find the file in the root directory
   // Hopefully file is the same as name
-  int inodeIdx = get_inode_from_name(file);
-  
+  int inodeIdx = get_inode_from_name(fs, file);
+
   // If the inode idx is <= 0 it is either the root dir or invalid
   // Do not remove it in this case
   if (inodeIdx <= 0) {
-    if (DEBUG) printf("File '%s' could not be found in the system", file);  
+    if (DEBUG) printf("File '%s' could not be found in the system", file);
     return -1;
   }
 
   // All of these are simplified due to simplified indexing used in the system (all same)
-  // Close the file if it is open
-  sfs_fclose(inodeIdx);
+  // Close the file if it is open, its block map goes with it
+  // Held back blocks are dropped rather than written
+  fs->delayed_blocks -= fs->fd_table[inodeIdx].da_count;
+  fs->fd_table[inodeIdx].da_count = 0;
+  sfs_close(fs, inodeIdx);
+  invalidate_block_map(fs, inodeIdx);
+  // The next file in this slot starts over with a small window
+  release_reservation(fs, inodeIdx);
+  fs->resv[inodeIdx].size = 0;
   // Remove the directory entry
   if (DEBUG==1) printf("Removing file %s directory entry \n", file);
-  root_directory[inodeIdx].filename = NULL;
-  root_directory[inodeIdx].inode = 0;
-  // Get the inode
-  inode_t curInode = inode_table[inodeIdx];
-
-  // Mark all the locations in the inode as free (direct data ptrs)
-  if (DEBUG==1) printf("Removing file %s direct pointers \n", file);
-  for (int i = 0; i < 12; i++){
-    int curBlockIdx = curInode.data_ptrs[i];
-    free_block_at(curBlockIdx);
-    curInode.data_ptrs[i] = 0;
-  }
-  // Mark all the locations in the inode as free (indirect data ptr)
-  int indirIdx = curInode.indirect_ptr;
-  if (indirIdx > 0){
-    if (DEBUG==1) printf("Removing file %s indirect pointers \n", file);
-    int *pointerPage = calloc(1,BLOCK_SIZE);
-    read_blocks(indirIdx, 1, (void*) pointerPage);
-    for (int i = 0; i < BLOCK_SIZE/PTR_SIZE; i ++){
-      if (pointerPage[i] != 0) free_block_at(pointerPage[i]);
-      pointerPage[i] = 0;
-    }
-    free_block_at(indirIdx);
-    curInode.indirect_ptr = 0;
-    free(pointerPage);
-  }
+  name_remove(fs, inodeIdx);
+  fs->root_directory[inodeIdx].filename[0] = '\0';
+  fs->root_directory[inodeIdx].inode = 0;
+  mark_dir_dirty(fs, inodeIdx);
+  // Get the inode (in place, the table is what gets written back)
+  inode_t* curInode = &fs->inode_table[inodeIdx];
+
+  // Mark all the extents of the inode as free, and the tree blocks holding them
+  // Only the bitmap in memory changes here, it is written once at the end
+  if (DEBUG==1) printf("Removing file %s extents \n", file);
+  free_extents(fs, curInode->extents, curInode->extent_count, curInode->extent_depth);
+  memset(curInode->extents, 0, sizeof(curInode->extents));
+  curInode->extent_count = 0;
+  curInode->extent_depth = 0;
 
   // Release rest of inode
   if (DEBUG==1) printf("Removing file %s inode \n", file);
-  curInode.size = 0;
-  curInode.mode = 0;
-   
+  curInode->size = 0;
+  curInode->mode = 0;
+  fs->groups[INODE_GROUP(fs, inodeIdx)].free_inodes++;
+  curInode->inline_data = 0;
+  memset(curInode->data, 0, INODE_INLINE);
+
   // Write all back to disk
-  // The inode table and root directory were modified, so write these to disk
-  write_blocks(1, NUM_INODE_BLOCKS, inode_table);
-  write_blocks(1+NUM_INODES, NUM_ROOTDIR_BLOCKS, root_directory);
+  // The bitmap, inode table and root directory were modified, one write each
+  mark_inode_dirty(fs, inodeIdx);
+  write_metadata(fs);
 
 
 	return 0;
 }
+
+
+///////////////////////////////////////////////////////////////////////////////
+//////////////////////// SINGLE VOLUME API ////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+// The assignment interface, everything goes to the volume mounted by mksfs()
+
+
+void mksfs(int fresh) {
+  // Unmount whatever was mounted before, then mount JITS_DISK
+  sfs_unmount(default_fs);
+  default_fs = sfs_mount(JITS_DISK, fresh, NULL);
+}
+
+int sfs_syncfs() {
+  if (default_fs == NULL) return -1;
+  return sfs_sync(default_fs);
+}
+
+int sfs_get_next_filename(char *fname) {
+  if (default_fs == NULL) return 0;
+  return sfs_next_filename(default_fs, fname);
+}
+
+int sfs_GetFileSize(const char* path) {
+  if (default_fs == NULL) return -1;
+  return sfs_size(default_fs, path);
+}
+
+int sfs_fopen(char *name) {
+  if (default_fs == NULL) return -1;
+  return sfs_open(default_fs, name);
+}
+
+int sfs_fclose(int fileID) {
+  if (default_fs == NULL) return -1;
+  return sfs_close(default_fs, fileID);
+}
+
+int sfs_fread(int fileID, char *buf, int length) {
+  if (default_fs == NULL) return -1;
+  return sfs_read(default_fs, fileID, buf, length);
+}
+
+int sfs_fwrite(int fileID, const char *buf, int length) {
+  if (default_fs == NULL) return -1;
+  return sfs_write(default_fs, fileID, buf, length);
+}
+
+int sfs_fseek(int fileID, int loc) {
+  if (default_fs == NULL) return -1;
+  return sfs_seek(default_fs, fileID, loc);
+}
+
+int sfs_fseek_data(int fileID, int loc) {
+  if (default_fs == NULL) return -1;
+  return sfs_seek_data(default_fs, fileID, loc);
+}
+
+int sfs_fseek_hole(int fileID, int loc) {
+  if (default_fs == NULL) return -1;
+  return sfs_seek_hole(default_fs, fileID, loc);
+}
+
+int sfs_fallocate(int fileID, int offset, int length) {
+  if (default_fs == NULL) return -1;
+  return sfs_allocate(default_fs, fileID, offset, length);
+}
+
+int sfs_remove(char *file) {
+  if (default_fs == NULL) return -1;
+  return sfs_unlink(default_fs, file);
+}
@@ -3,44 +3,132 @@
 
 #include <stdint.h>
 
+#include "disk_emu.h"
+
 #define MAXFILENAME 20
 
 typedef struct {
     int magic;
     int block_size;
-    int fs_size;
-    int inode_table_len;
+    int fs_size;          // in blocks
+    int inode_table_len;  // in blocks, the slices of all groups
     int root_dir_inode;
+    int group_blocks;
+    int inode_count;
 } superblock_t;
 
+/*
+ * Geometry of a new volume, see sfs_format(). A field left 0 takes the
+ * default of sfs_api.c, except group_blocks which then is as large as
+ * one bitmap block allows
+ * block_size   bytes per block, a power of two from 512 to 65536
+ * num_blocks   size of the volume in blocks
+ * num_inodes   most files it can hold, the root directory included
+ * group_blocks blocks per block group, a multiple of 64 up to 8 * block_size
+ */
+typedef struct {
+    int block_size;
+    int num_blocks;
+    int num_inodes;
+    int group_blocks;
+} sfs_geometry;
+
+// Extents held by the inode itself, see the EXTENT MAP section of sfs_api.c
+#define INODE_EXTENTS 4
+
+/*
+ * logical   first block of the file it maps
+ * start     first physical block
+ * length    number of blocks
+ * unwritten 1 if the blocks were allocated ahead (sfs_allocate) and never
+ *           written, they read as zeros
+ */
+typedef struct {
+    int logical;
+    int start;
+    int length;
+    int unwritten;
+} extent_t;
+
+// Bytes of a small file kept in the inode itself, so that inode_t is 512 bytes
+#define INODE_INLINE 416
+
 typedef struct {
     int mode;
     int link_cnt;
     int uid;
     int gid;
     int size;
-    int data_ptrs[12];
-    int indirect_ptr;
+    int extent_depth;   // 0 if extents[] map the file, else levels of tree blocks below them
+    int extent_count;   // entries used in extents[]
+    extent_t extents[INODE_EXTENTS];
+    int inline_data;    // 1 while the file is in data[] and has no blocks
+    char data[INODE_INLINE];
 } inode_t;
 
 /*
- * inode    which inode this entry describes
- * rwptr    where in the file to start
+ * inode      which inode this entry describes
+ * rwptr      where in the file to start
+ * map_extent the extent used last, length 0 if none
+ * map_leaf   the extent tree leaf used last, 0 if none, it covers blocks
+ *            map_leaf_lo up to map_leaf_hi
+ * ra_next    where the next read starts if the file is read sequentially
+ * ra_window  read ahead window in blocks, 0 after a random read
+ * ra_end     first block past what has been read ahead
+ * da_buf     appended blocks not allocated yet (delayed allocation), da_count
+ *            of them starting at block da_first of the file
  */
 typedef struct {
     int inode;
     int rwptr;
+    extent_t map_extent;
+    int map_leaf;
+    int map_leaf_lo;
+    int map_leaf_hi;
+    int ra_next;
+    int ra_window;
+    int ra_end;
+    char *da_buf;
+    int da_first;
+    int da_count;
 } file_descriptor;
 
 // Very simple mapping from filename to inode
 // Don't care about performance so can just iterate over all files in dir
+// The name is stored in the entry so that the directory block is self contained
 typedef struct {
-  char* filename;
+  char filename[MAXFILENAME+1];
   int inode;
 } file_map;
 
 
+// A mounted volume, see sfs_mount()
+typedef struct sfs sfs_t;
+
+// Handle based API, any number of volumes can be mounted at once
+// config and geometry may be NULL for the defaults in sfs_api.c
+// sfs_mount() formats a fresh volume with the default geometry, an
+// existing one keeps the geometry it was formatted with
+sfs_t* sfs_format(char *disk_name, const sfs_geometry *geometry, const disk_config *config);
+sfs_t* sfs_mount(char *disk_name, int fresh, const disk_config *config);
+int sfs_unmount(sfs_t *fs);
+int sfs_sync(sfs_t *fs);
+disk_t* sfs_disk(sfs_t *fs);
+int sfs_next_filename(sfs_t *fs, char *fname);
+int sfs_size(sfs_t *fs, const char* path);
+int sfs_open(sfs_t *fs, char *name);
+int sfs_close(sfs_t *fs, int fileID);
+int sfs_read(sfs_t *fs, int fileID, char *buf, int length);
+int sfs_write(sfs_t *fs, int fileID, const char *buf, int length);
+int sfs_seek(sfs_t *fs, int fileID, int loc);
+int sfs_seek_data(sfs_t *fs, int fileID, int loc);
+int sfs_seek_hole(sfs_t *fs, int fileID, int loc);
+int sfs_allocate(sfs_t *fs, int fileID, int offset, int length);
+int sfs_unlink(sfs_t *fs, char *file);
+
+// Single volume API, works on the volume mounted by the last mksfs() call
 void mksfs(int fresh);
+int sfs_syncfs();
 int sfs_getnextfilename(char *fname);
 int sfs_getfilesize(const char* path);
 int sfs_fopen(char *name);
@@ -48,6 +136,9 @@ int sfs_fclose(int fileID);
 int sfs_fread(int fileID, char *buf, int length);
 int sfs_fwrite(int fileID, const char *buf, int length);
 int sfs_fseek(int fileID, int loc);
+int sfs_fseek_data(int fileID, int loc);
+int sfs_fseek_hole(int fileID, int loc);
+int sfs_fallocate(int fileID, int offset, int length);
 int sfs_remove(char *file);
 
 #endif //_INCLUDE_SFS_API_H_
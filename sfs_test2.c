@@ -5,8 +5,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include "sfs_api.h"
+#include "disk_emu.h"
 
 /* The maximum file name length. We assume that filenames can contain
  * upper-case letters and periods ('.') characters. Feel free to
@@ -59,6 +62,951 @@ char *rand_name()
   return (strdup(fname));
 }
 
+/* Geometry of the scratch images used to test the disk layer on its own
+ */
+#define TEST_BLOCK_SIZE 1024
+#define TEST_BLOCKS 64
+
+/* remove_image() - delete a scratch disk image once a test is done with it.
+ *
+ * A striped image names its member files separated by ':', each of them
+ * is deleted.
+ */
+void remove_image(char *image)
+{
+  char names[MAX_FNAME_LENGTH * 4];
+  char *name, *save;
+
+  strncpy(names, image, sizeof(names) - 1);
+  names[sizeof(names) - 1] = '\0';
+  for (name = strtok_r(names, ":", &save); name != NULL; name = strtok_r(NULL, ":", &save))
+    unlink(name);
+}
+
+/* fill_blocks() - give every block of buf its own byte pattern.
+ */
+void fill_blocks(char *buf, int nblocks)
+{
+  int i;
+
+  for (i = 0; i < nblocks * TEST_BLOCK_SIZE; i++) {
+    buf[i] = (char)(i / TEST_BLOCK_SIZE * 31 + i);
+  }
+}
+
+/* mount_volume() - mount a scratch volume, complaining if that fails.
+ */
+sfs_t *mount_volume(char *image, int fresh, const disk_config *config)
+{
+  sfs_t *fs = sfs_mount(image, fresh, config);
+
+  if (fs == NULL) {
+    fprintf(stderr, "ERROR: could not mount %s\n", image);
+  }
+  return fs;
+}
+
+/* remount_volume() - unmount a volume and mount its image again.
+ */
+sfs_t *remount_volume(sfs_t *fs, char *image, const disk_config *config)
+{
+  sfs_unmount(fs);
+  return mount_volume(image, 0, config);
+}
+
+/* remove_volume() - unmount a scratch volume (if mounted) and delete its image.
+ */
+void remove_volume(sfs_t *fs, char *image)
+{
+  if (fs != NULL) {
+    sfs_unmount(fs);
+  }
+  remove_image(image);
+}
+
+/* check_file() - read a whole file back and compare it with its data.
+ *
+ * Returns the number of errors found: a wrong size or wrong contents.
+ */
+int check_file(sfs_t *fs, char *name, const char *data, int len)
+{
+  char *buf = malloc(len + 1);
+  int error_count = 0;
+  int fd, n;
+
+  if (sfs_size(fs, name) != len) {
+    fprintf(stderr, "ERROR: %s is %d bytes, expected %d\n", name, sfs_size(fs, name), len);
+    error_count++;
+  }
+  fd = sfs_open(fs, name);
+  sfs_seek(fs, fd, 0);
+  n = sfs_read(fs, fd, buf, len + 1);
+  if (n != len || memcmp(buf, data, len)) {
+    fprintf(stderr, "ERROR: %s reads back wrong (%d of %d bytes)\n", name, n, len);
+    error_count++;
+  }
+  sfs_close(fs, fd);
+  free(buf);
+  return error_count;
+}
+
+/* test_disk_round_trip() - write blocks to a fresh image and read them back.
+ *
+ * The first half of the image is written as one range, the second half
+ * from four separate buffers. After a barrier the image is closed and
+ * opened again in the same mode, and reading it as one range or into
+ * four buffers must give back the same bytes. A mapped image must also
+ * show them through get_block_ptr(), and with O_DIRECT the aligned pool
+ * buffers must work as well as the bounced ones.
+ */
+int test_disk_round_trip(char *image, int mode)
+{
+  static char buf[TEST_BLOCKS * TEST_BLOCK_SIZE], out[TEST_BLOCKS * TEST_BLOCK_SIZE];
+  int quarter = TEST_BLOCKS / 4 * TEST_BLOCK_SIZE;
+  struct iovec iov[4];
+  int error_count = 0;
+  int i, n;
+
+  fill_blocks(buf, TEST_BLOCKS);
+  close_disk();
+  set_disk_mode(mode);
+  if (init_fresh_disk(image, TEST_BLOCK_SIZE, TEST_BLOCKS) != 0) {
+    fprintf(stderr, "ERROR: could not create the image %s\n", image);
+    set_disk_mode(DISK_PIO);
+    return 1;
+  }
+
+  if ((n = write_blocks(0, TEST_BLOCKS / 2, buf)) != TEST_BLOCKS / 2) {
+    fprintf(stderr, "ERROR: wrote %d of %d blocks to %s\n", n, TEST_BLOCKS / 2, image);
+    error_count++;
+  }
+  for (i = 0; i < 2; i++) {
+    iov[i].iov_base = buf + 2 * quarter + i * quarter / 2;
+    iov[i].iov_len = quarter / 2;
+    iov[i + 2].iov_base = buf + 3 * quarter + i * quarter / 2;
+    iov[i + 2].iov_len = quarter / 2;
+  }
+  if ((n = write_blocksv(TEST_BLOCKS / 2, iov, 4)) != TEST_BLOCKS / 2) {
+    fprintf(stderr, "ERROR: wrote %d of %d scattered blocks to %s\n", n, TEST_BLOCKS / 2, image);
+    error_count++;
+  }
+  if (sync_disk() != 0) {
+    fprintf(stderr, "ERROR: could not make %s durable\n", image);
+    error_count++;
+  }
+  close_disk();
+
+  if (init_disk(image, TEST_BLOCK_SIZE, TEST_BLOCKS) != 0) {
+    fprintf(stderr, "ERROR: could not open the image %s again\n", image);
+    set_disk_mode(DISK_PIO);
+    remove_image(image);
+    return error_count + 1;
+  }
+  memset(out, 0, sizeof(out));
+  n = read_blocks(0, TEST_BLOCKS, out);
+  if (n != TEST_BLOCKS || memcmp(buf, out, sizeof(buf))) {
+    fprintf(stderr, "ERROR: %s reads back wrong (%d blocks)\n", image, n);
+    error_count++;
+  }
+
+  /* The quarters land in the buffer in reverse order */
+  memset(out, 0, sizeof(out));
+  for (i = 0; i < 4; i++) {
+    iov[i].iov_base = out + (3 - i) * quarter;
+    iov[i].iov_len = quarter;
+  }
+  n = read_blocksv(0, iov, 4);
+  for (i = 0; i < 4; i++) {
+    if (n != TEST_BLOCKS || memcmp(buf + i * quarter, out + (3 - i) * quarter, quarter)) {
+      fprintf(stderr, "ERROR: %s reads back wrong into scattered buffers\n", image);
+      error_count++;
+      break;
+    }
+  }
+
+  if (mode == DISK_MMAP) {
+    for (i = 0; i < TEST_BLOCKS; i++) {
+      char *block = get_block_ptr(i);
+      if (block == NULL || memcmp(block, buf + i * TEST_BLOCK_SIZE, TEST_BLOCK_SIZE)) {
+        fprintf(stderr, "ERROR: block %d of %s is wrong in place\n", i, image);
+        error_count++;
+        break;
+      }
+    }
+    if (sync_blocks(TEST_BLOCKS / 4, TEST_BLOCKS / 2) != 0) {
+      fprintf(stderr, "ERROR: could not make part of %s durable\n", image);
+      error_count++;
+    }
+  }
+
+  if (mode == DISK_DIRECT) {
+    char *block = get_block_buffer();
+    n = read_blocks(TEST_BLOCKS - 1, 1, block);
+    if (n != 1 || memcmp(block, buf + (TEST_BLOCKS - 1) * TEST_BLOCK_SIZE, TEST_BLOCK_SIZE)) {
+      fprintf(stderr, "ERROR: %s reads back wrong into a pool buffer\n", image);
+      error_count++;
+    }
+    put_block_buffer(block);
+  }
+
+  close_disk();
+  set_disk_mode(DISK_PIO);
+  remove_image(image);
+  return error_count;
+}
+
+/* test_disk_batch() - keep a batch of requests in flight at once.
+ *
+ * The image is written by one batch of requests issued last block first
+ * and read back by another. Every request must report all of its blocks,
+ * and one reaching past the end of the image must fail on its own.
+ */
+int test_disk_batch(char *image)
+{
+  static char buf[TEST_BLOCKS * TEST_BLOCK_SIZE], out[TEST_BLOCKS * TEST_BLOCK_SIZE];
+  disk_request reqs[TEST_BLOCKS / 4 + 1];
+  int nreqs = TEST_BLOCKS / 4;
+  int error_count = 0;
+  int i, op;
+
+  fill_blocks(buf, TEST_BLOCKS);
+  close_disk();
+  if (init_fresh_disk(image, TEST_BLOCK_SIZE, TEST_BLOCKS) != 0) {
+    fprintf(stderr, "ERROR: could not create the image %s\n", image);
+    return 1;
+  }
+
+  memset(out, 0, sizeof(out));
+  for (op = DISK_WRITE; op >= DISK_READ; op--) {
+    for (i = 0; i < nreqs; i++) {
+      int block = (nreqs - 1 - i) * 4;
+      char *data = op == DISK_WRITE ? buf : out;
+      reqs[i] = (disk_request) { op, block, 4, data + block * TEST_BLOCK_SIZE };
+    }
+    if (submit_blocks(reqs, nreqs) != nreqs || wait_blocks(reqs, nreqs) != 0) {
+      fprintf(stderr, "ERROR: a batch of %s failed\n", op == DISK_WRITE ? "writes" : "reads");
+      error_count++;
+    }
+    for (i = 0; i < nreqs; i++) {
+      if (!reqs[i].done || reqs[i].result != 4) {
+        fprintf(stderr, "ERROR: request %d of a batch moved %d blocks\n", i, reqs[i].result);
+        error_count++;
+        break;
+      }
+    }
+  }
+  if (memcmp(buf, out, sizeof(buf))) {
+    fprintf(stderr, "ERROR: %s reads back wrong through a batch\n", image);
+    error_count++;
+  }
+
+  reqs[0] = (disk_request) { DISK_READ, 0, 4, out };
+  reqs[1] = (disk_request) { DISK_READ, TEST_BLOCKS - 2, 4, out + 4 * TEST_BLOCK_SIZE };
+  submit_blocks(reqs, 2);
+  if (wait_blocks(reqs, 2) != -1 || reqs[0].result != 4 || reqs[1].result != -1) {
+    fprintf(stderr, "ERROR: a request past the end of %s did not fail alone\n", image);
+    error_count++;
+  }
+
+  close_disk();
+  remove_image(image);
+  return error_count;
+}
+
+/* test_disk_failure() - requests on a device that always fails.
+ *
+ * With every attempt failing, each request gives up after its retries
+ * and reports how many attempts failed, without moving any data: a read
+ * leaves its buffer alone and a write leaves the image as it was.
+ */
+int test_disk_failure(char *image)
+{
+  static char buf[TEST_BLOCKS * TEST_BLOCK_SIZE], out[TEST_BLOCKS * TEST_BLOCK_SIZE];
+  disk_model failing = DISK_MODEL_NONE;
+  disk_request reqs[2];
+  struct iovec iov;
+  int error_count = 0;
+  int i;
+
+  fill_blocks(buf, TEST_BLOCKS);
+  close_disk();
+  if (init_fresh_disk(image, TEST_BLOCK_SIZE, TEST_BLOCKS) != 0 ||
+      write_blocks(0, TEST_BLOCKS, buf) != TEST_BLOCKS) {
+    fprintf(stderr, "ERROR: could not create the image %s\n", image);
+    return 1;
+  }
+  close_disk();
+
+  failing.failure_p = 1;
+  failing.max_retry = 2;
+  set_disk_model(&failing);
+  init_disk(image, TEST_BLOCK_SIZE, TEST_BLOCKS);
+  memset(out, 0x5a, sizeof(out));
+  if (write_blocks(0, 4, out) >= 0 || read_blocks(0, 4, out) >= 0) {
+    fprintf(stderr, "ERROR: a request to a failing device succeeded\n");
+    error_count++;
+  }
+  iov = (struct iovec) { out, 4 * TEST_BLOCK_SIZE };
+  if (read_blocksv(4, &iov, 1) != -(failing.max_retry + 1)) {
+    fprintf(stderr, "ERROR: a failed read did not report its %d attempts\n", failing.max_retry + 1);
+    error_count++;
+  }
+  reqs[0] = (disk_request) { DISK_WRITE, 8, 4, out };
+  reqs[1] = (disk_request) { DISK_READ, 12, 4, out };
+  submit_blocks(reqs, 2);
+  if (wait_blocks(reqs, 2) != -1 || reqs[0].result >= 0 || reqs[1].result >= 0) {
+    fprintf(stderr, "ERROR: a batch on a failing device succeeded\n");
+    error_count++;
+  }
+  for (i = 0; i < (int)sizeof(out); i++) {
+    if (out[i] != 0x5a) {
+      fprintf(stderr, "ERROR: a failed read wrote byte %d of its buffer\n", i);
+      error_count++;
+      break;
+    }
+  }
+  close_disk();
+
+  set_disk_model(&DISK_MODEL_NONE);
+  init_disk(image, TEST_BLOCK_SIZE, TEST_BLOCKS);
+  if (read_blocks(0, TEST_BLOCKS, out) != TEST_BLOCKS || memcmp(buf, out, sizeof(buf))) {
+    fprintf(stderr, "ERROR: a failed write changed %s\n", image);
+    error_count++;
+  }
+
+  close_disk();
+  remove_image(image);
+  return error_count;
+}
+
+/* test_stripe_layout() - check where striped blocks end up.
+ *
+ * With a stripe unit of four blocks over three members, blocks 4-7 are
+ * the first blocks of the second member and blocks 12-15 follow blocks
+ * 0-3 on the first one.
+ */
+int test_stripe_layout(char *image)
+{
+  static char buf[TEST_BLOCKS * TEST_BLOCK_SIZE];
+  char member[4 * TEST_BLOCK_SIZE];
+  int error_count = 0;
+  FILE *fp;
+
+  fill_blocks(buf, TEST_BLOCKS);
+  close_disk();
+  set_stripe_unit(4);
+  if (init_fresh_disk(image, TEST_BLOCK_SIZE, TEST_BLOCKS) != 0 ||
+      write_blocks(0, TEST_BLOCKS, buf) != TEST_BLOCKS) {
+    fprintf(stderr, "ERROR: could not create the image %s\n", image);
+    set_stripe_unit(DISK_STRIPE_UNIT);
+    return 1;
+  }
+  close_disk();
+  set_stripe_unit(DISK_STRIPE_UNIT);
+
+  fp = fopen("sfs_test_b.disk", "r");
+  if (fp == NULL || fread(member, 1, sizeof(member), fp) != sizeof(member) ||
+      memcmp(member, buf + 4 * TEST_BLOCK_SIZE, sizeof(member))) {
+    fprintf(stderr, "ERROR: blocks 4-7 are not at the start of the second member\n");
+    error_count++;
+  }
+  if (fp != NULL)
+    fclose(fp);
+  fp = fopen("sfs_test_a.disk", "r");
+  if (fp == NULL || fseek(fp, sizeof(member), SEEK_SET) != 0 ||
+      fread(member, 1, sizeof(member), fp) != sizeof(member) ||
+      memcmp(member, buf + 12 * TEST_BLOCK_SIZE, sizeof(member))) {
+    fprintf(stderr, "ERROR: blocks 12-15 do not follow blocks 0-3 on the first member\n");
+    error_count++;
+  }
+  if (fp != NULL)
+    fclose(fp);
+
+  remove_image(image);
+  return error_count;
+}
+
+/* test_fresh_image() - format over an old image.
+ *
+ * A fresh image takes the place of a file full of junk. It must read as
+ * zeros all through, have its full size and be sparse, with (next to)
+ * no space allocated to it yet.
+ */
+int test_fresh_image(char *image)
+{
+  static char buf[TEST_BLOCKS * TEST_BLOCK_SIZE];
+  int error_count = 0;
+  struct stat st;
+  FILE *junk;
+  int i, n;
+
+  memset(buf, 0x5a, sizeof(buf));
+  junk = fopen(image, "w");
+  if (junk != NULL) {
+    fwrite(buf, 1, sizeof(buf), junk);
+    fclose(junk);
+  }
+
+  close_disk();
+  if (init_fresh_disk(image, TEST_BLOCK_SIZE, TEST_BLOCKS) != 0) {
+    fprintf(stderr, "ERROR: could not create the image %s\n", image);
+    return 1;
+  }
+  if (stat(image, &st) != 0 || st.st_size != sizeof(buf) ||
+      (long long)st.st_blocks * 512 >= (long long)sizeof(buf)) {
+    fprintf(stderr, "ERROR: fresh image %s is not sparse\n", image);
+    error_count++;
+  }
+  n = read_blocks(0, TEST_BLOCKS, buf);
+  for (i = 0; i < (int)sizeof(buf); i++) {
+    if (n != TEST_BLOCKS || buf[i] != 0) {
+      fprintf(stderr, "ERROR: byte %d of fresh image %s is %d, not 0\n", i, image, buf[i]);
+      error_count++;
+      break;
+    }
+  }
+
+  close_disk();
+  remove_image(image);
+  return error_count;
+}
+
+/* test_volume_round_trip() - write a file and read it back after a remount.
+ *
+ * The file is written 700 bytes at a time, so most writes patch part of
+ * a block, and is large enough to need its indirect block. It must read
+ * back the same from the volume mounted again with the same config.
+ */
+int test_volume_round_trip(char *image, const disk_config *config)
+{
+  static char data[20000];
+  int error_count = 0;
+  int fd, i;
+  sfs_t *fs;
+
+  for (i = 0; i < (int)sizeof(data); i++) {
+    data[i] = (char)(i * 7 + i / 1024);
+  }
+  fs = mount_volume(image, 1, config);
+  if (fs == NULL) {
+    remove_image(image);
+    return 1;
+  }
+  fd = sfs_open(fs, "round.txt");
+  for (i = 0; i < (int)sizeof(data); i += 700) {
+    int chunk = sizeof(data) - i < 700 ? sizeof(data) - i : 700;
+    if (sfs_write(fs, fd, data + i, chunk) != chunk) {
+      fprintf(stderr, "ERROR: write of %d bytes at %d to round.txt failed\n", chunk, i);
+      error_count++;
+      break;
+    }
+  }
+  sfs_close(fs, fd);
+
+  fs = remount_volume(fs, image, config);
+  if (fs == NULL) {
+    remove_image(image);
+    return error_count + 1;
+  }
+  error_count += check_file(fs, "round.txt", data, sizeof(data));
+
+  remove_volume(fs, image);
+  return error_count;
+}
+
+/* test_volume_modes() - run the volume round trip with every disk_config.
+ */
+int test_volume_modes()
+{
+  disk_config config = { DISK_PIO, DISK_STRIPE_UNIT, { 0 } };
+  int error_count = 0;
+
+  error_count += test_volume_round_trip("sfs_test_volume.disk", &config);
+  config.mode = DISK_MMAP;
+  error_count += test_volume_round_trip("sfs_test_volume.disk", &config);
+  config.mode = DISK_DIRECT;
+  error_count += test_volume_round_trip("sfs_test_volume.disk", &config);
+  config.mode = DISK_PIO;
+  config.stripe_unit = 4;
+  error_count += test_volume_round_trip("sfs_test_a.disk:sfs_test_b.disk:sfs_test_c.disk", &config);
+  config.mode = DISK_MMAP;
+  error_count += test_volume_round_trip("sfs_test_a.disk:sfs_test_b.disk:sfs_test_c.disk", &config);
+  return error_count;
+}
+
+/* test_fragmented_reads() - read files whose blocks are interleaved on disk.
+ *
+ * Two files are written a block at a time, taking turns, so neither has
+ * two neighbouring blocks and each runs into its indirect block. Every
+ * read then crosses from one piece of a file to another: first going
+ * through each file in chunks of an odd size, then at random offsets
+ * and lengths.
+ */
+#define FRAG_FILE_LEN (20 * 1024)
+
+int test_fragmented_reads(char *image)
+{
+  static char data[2][FRAG_FILE_LEN], buf[FRAG_FILE_LEN];
+  static char *names[2] = { "frag0.txt", "frag1.txt" };
+  disk_config config = { DISK_PIO, DISK_STRIPE_UNIT, { 0 } };
+  unsigned int seed = 1;
+  int error_count = 0;
+  int fds[2];
+  int f, i, n, pos, len;
+  sfs_t *fs;
+
+  for (f = 0; f < 2; f++) {
+    for (i = 0; i < FRAG_FILE_LEN; i++) {
+      data[f][i] = (char)(i * (f + 3) + i / 1024);
+    }
+  }
+  fs = mount_volume(image, 1, &config);
+  if (fs == NULL) {
+    remove_image(image);
+    return 1;
+  }
+  for (f = 0; f < 2; f++) {
+    fds[f] = sfs_open(fs, names[f]);
+  }
+  for (i = 0; i < FRAG_FILE_LEN; i += 1024) {
+    for (f = 0; f < 2; f++) {
+      if (sfs_write(fs, fds[f], data[f] + i, 1024) != 1024) {
+        fprintf(stderr, "ERROR: write at %d to %s failed\n", i, names[f]);
+        error_count++;
+      }
+    }
+  }
+
+  for (f = 0; f < 2; f++) {
+    sfs_seek(fs, fds[f], 0);
+    for (pos = 0; pos < FRAG_FILE_LEN; pos += n) {
+      n = sfs_read(fs, fds[f], buf, 333);
+      if (n <= 0 || n > 333 || memcmp(buf, data[f] + pos, n)) {
+        fprintf(stderr, "ERROR: sequential read at %d of %s returned %d wrong bytes\n", pos, names[f], n);
+        error_count++;
+        break;
+      }
+    }
+  }
+
+  for (i = 0; i < 200; i++) {
+    f = i % 2;
+    pos = rand_r(&seed) % FRAG_FILE_LEN;
+    len = 1 + rand_r(&seed) % 5000;
+    if (len > FRAG_FILE_LEN - pos) {
+      len = FRAG_FILE_LEN - pos;
+    }
+    sfs_seek(fs, fds[f], pos);
+    n = sfs_read(fs, fds[f], buf, len);
+    if (n != len || memcmp(buf, data[f] + pos, len)) {
+      fprintf(stderr, "ERROR: read of %d bytes at %d of %s returned %d wrong bytes\n", len, pos, names[f], n);
+      error_count++;
+      break;
+    }
+  }
+
+  remove_volume(fs, image);
+  return error_count;
+}
+
+/* test_short_counts() - reads and writes on a device that fails now and then.
+ *
+ * A file is read and then appended to on a volume whose requests fail
+ * once in a while without retries. A failure may cut a read or write
+ * short, but whatever count comes back must be exact: the bytes read
+ * are the ones at the file position, and the file grows by exactly
+ * what the writes returned. The file stays within the direct blocks so
+ * that only data requests can fail once the file is found.
+ */
+#define SHORT_FILE_LEN (10 * 1024)
+#define SHORT_APPEND_LEN 1500
+
+int test_short_counts(char *image)
+{
+  static char data[SHORT_FILE_LEN], buf[SHORT_FILE_LEN];
+  disk_config clean = { DISK_PIO, DISK_STRIPE_UNIT, { 0 } };
+  disk_config failing = clean;
+  int error_count = 0;
+  int short_counts = 0;
+  int trial, tries, fd, n, pos, i;
+  sfs_t *fs;
+
+  failing.model.failure_p = 0.05;
+  failing.model.max_retry = 0;
+  for (i = 0; i < SHORT_FILE_LEN; i++) {
+    data[i] = (char)(i * 13 + i / 1024);
+  }
+
+  for (trial = 0; trial < 50 && error_count == 0; trial++) {
+    fs = mount_volume(image, 1, &clean);
+    if (fs == NULL) {
+      remove_image(image);
+      return error_count + 1;
+    }
+    fd = sfs_open(fs, "short.txt");
+    if (sfs_write(fs, fd, data, SHORT_FILE_LEN) != SHORT_FILE_LEN) {
+      fprintf(stderr, "ERROR: could not write short.txt\n");
+      error_count++;
+    }
+    sfs_unmount(fs);
+
+    failing.model.seed = trial + 1;
+    /* A failure while mounting may lose track of the file, such a trial
+     * says nothing about short counts */
+    fs = sfs_mount(image, 0, &failing);
+    if (fs == NULL || sfs_size(fs, "short.txt") != SHORT_FILE_LEN) {
+      remove_volume(fs, image);
+      continue;
+    }
+    fd = sfs_open(fs, "short.txt");
+
+    sfs_seek(fs, fd, 0);
+    for (pos = 0, tries = 0; pos < SHORT_FILE_LEN && tries < 100; tries++) {
+      n = sfs_read(fs, fd, buf, SHORT_FILE_LEN - pos);
+      if (n < 0 || n > SHORT_FILE_LEN - pos || memcmp(buf, data + pos, n)) {
+        fprintf(stderr, "ERROR: read at %d of short.txt returned %d wrong bytes\n", pos, n);
+        error_count++;
+        break;
+      }
+      if (n < SHORT_FILE_LEN - pos) {
+        short_counts++;
+      }
+      pos += n;
+    }
+
+    sfs_seek(fs, fd, SHORT_FILE_LEN);
+    for (pos = 0, tries = 0; pos < SHORT_APPEND_LEN && tries < 100; tries++) {
+      n = sfs_write(fs, fd, data + pos, SHORT_APPEND_LEN - pos);
+      if (n < 0 || n > SHORT_APPEND_LEN - pos) {
+        fprintf(stderr, "ERROR: append at %d to short.txt returned %d\n", pos, n);
+        error_count++;
+        break;
+      }
+      if (n < SHORT_APPEND_LEN - pos) {
+        short_counts++;
+      }
+      pos += n;
+      if (sfs_size(fs, "short.txt") != SHORT_FILE_LEN + pos) {
+        fprintf(stderr, "ERROR: short.txt is %d bytes after appending %d\n", sfs_size(fs, "short.txt"), pos);
+        error_count++;
+        break;
+      }
+    }
+
+    sfs_seek(fs, fd, SHORT_FILE_LEN);
+    for (pos = 0, tries = 0; pos < SHORT_APPEND_LEN && tries < 100; tries++) {
+      n = sfs_read(fs, fd, buf, SHORT_APPEND_LEN - pos);
+      if (n < 0 || memcmp(buf, data + pos, n)) {
+        fprintf(stderr, "ERROR: appended bytes at %d of short.txt read back wrong\n", pos);
+        error_count++;
+        break;
+      }
+      pos += n;
+    }
+    remove_volume(fs, image);
+  }
+
+  if (short_counts == 0) {
+    fprintf(stderr, "ERROR: no read or write came back short in %d trials\n", trial);
+    error_count++;
+  }
+  return error_count;
+}
+
+/* test_mmap_fresh_block() - write into a block allocated ahead on a
+ * memory-mapped image.
+ *
+ * The volume is filled with junk which is then removed, so that the
+ * blocks handed out next still hold it on disk. A one byte write into the
+ * last block allocated by sfs_allocate() must leave the rest of that
+ * block reading as zeros, not as the junk.
+ */
+int test_mmap_fresh_block(char *image)
+{
+  disk_config config = { DISK_MMAP, DISK_STRIPE_UNIT, { 0 } };
+  static char buf[200000];
+  int error_count = 0;
+  int fd, i, n;
+  sfs_t *fs;
+
+  fs = mount_volume(image, 1, &config);
+  if (fs == NULL) {
+    remove_image(image);
+    return 1;
+  }
+
+  memset(buf, 0x5a, sizeof(buf));
+  fd = sfs_open(fs, "JUNK.TXT");
+  sfs_write(fs, fd, buf, sizeof(buf));
+  sfs_close(fs, fd);
+  sfs_unlink(fs, "JUNK.TXT");
+
+  fd = sfs_open(fs, "FRESH.TXT");
+  if (sfs_allocate(fs, fd, 36590, 5346) != 0) {
+    fprintf(stderr, "ERROR: allocating 5346 bytes at 36590 failed\n");
+    error_count++;
+  }
+  sfs_seek(fs, fd, 41936);
+  sfs_write(fs, fd, "x", 1);
+
+  sfs_seek(fs, fd, 0);
+  memset(buf, 1, sizeof(buf));
+  n = sfs_read(fs, fd, buf, 41937);
+  if (n != 41937 || buf[41936] != 'x') {
+    fprintf(stderr, "ERROR: read %d bytes back from the mapped volume\n", n);
+    error_count++;
+  }
+  for (i = 0; i < 41936 && i < n; i++) {
+    if (buf[i] != 0) {
+      fprintf(stderr, "ERROR: byte %d of a fresh block is %d, not 0\n", i, buf[i]);
+      error_count++;
+      break;
+    }
+  }
+
+  sfs_close(fs, fd);
+  remove_volume(fs, image);
+  return error_count;
+}
+
+/* test_allocated_unwritten() - read a range allocated ahead of the writes.
+ *
+ * Junk is written and removed first, so that the blocks sfs_allocate()
+ * hands out still hold it on disk. The allocated range must read as
+ * zeros and the bytes written before it must be untouched, also after
+ * a remount.
+ */
+int test_allocated_unwritten(char *image)
+{
+  static char buf[60000];
+  int len = strlen(test_str);
+  int error_count = 0;
+  int fd, i, n, pass;
+  sfs_t *fs;
+
+  fs = mount_volume(image, 1, NULL);
+  if (fs == NULL) {
+    remove_image(image);
+    return 1;
+  }
+
+  memset(buf, 0x5a, sizeof(buf));
+  fd = sfs_open(fs, "JUNK.TXT");
+  sfs_write(fs, fd, buf, sizeof(buf));
+  sfs_close(fs, fd);
+  sfs_unlink(fs, "JUNK.TXT");
+
+  fd = sfs_open(fs, "AHEAD.TXT");
+  sfs_write(fs, fd, test_str, len);
+  if (sfs_allocate(fs, fd, len, 5000) != 0) {
+    fprintf(stderr, "ERROR: allocating 5000 bytes ahead failed\n");
+    error_count++;
+  }
+  sfs_close(fs, fd);
+
+  for (pass = 0; pass < 2; pass++) {
+    if (pass == 1 && (fs = remount_volume(fs, image, NULL)) == NULL) {
+      remove_image(image);
+      return error_count + 1;
+    }
+    n = sfs_size(fs, "AHEAD.TXT");
+    if (n != len + 5000) {
+      fprintf(stderr, "ERROR: size after allocating is %d\n", n);
+      error_count++;
+    }
+
+    fd = sfs_open(fs, "AHEAD.TXT");
+    sfs_seek(fs, fd, 0);
+    memset(buf, 1, sizeof(buf));
+    n = sfs_read(fs, fd, buf, sizeof(buf));
+    if (n != len + 5000 || memcmp(buf, test_str, len)) {
+      fprintf(stderr, "ERROR: read %d bytes back from the allocated file\n", n);
+      error_count++;
+    }
+    for (i = len; i < n; i++) {
+      if (buf[i] != 0) {
+        fprintf(stderr, "ERROR: byte %d allocated but not written is %d, not 0\n", i, buf[i]);
+        error_count++;
+        break;
+      }
+    }
+    sfs_close(fs, fd);
+  }
+
+  remove_volume(fs, image);
+  return error_count;
+}
+
+/* test_sparse_boundaries() - find the data and the holes of a sparse file.
+ *
+ * Writes past the end of the file leave holes behind. sfs_seek_data()
+ * and sfs_seek_hole() must stop on the block boundaries around the
+ * written bytes, the end of the file counts as a hole, and the holes
+ * must read as zeros.
+ */
+int test_sparse_boundaries(char *image)
+{
+  static char buf[20000];
+  int error_count = 0;
+  int fd, bs, i, n;
+  sfs_t *fs;
+
+  fs = mount_volume(image, 1, NULL);
+  if (fs == NULL) {
+    remove_image(image);
+    return 1;
+  }
+  bs = disk_block_size(sfs_disk(fs));
+
+  /* Data in blocks 2 and 3 and in block 8, holes in between */
+  fd = sfs_open(fs, "SPARSE.TXT");
+  memset(buf, 'd', sizeof(buf));
+  sfs_seek(fs, fd, 3 * bs - 100);
+  sfs_write(fs, fd, buf, 200);
+  sfs_seek(fs, fd, 8 * bs);
+  sfs_write(fs, fd, buf, 10);
+
+  if ((n = sfs_seek_data(fs, fd, 0)) != 2 * bs) {
+    fprintf(stderr, "ERROR: first data at %d, not %d\n", n, 2 * bs);
+    error_count++;
+  }
+  if ((n = sfs_seek_hole(fs, fd, 2 * bs)) != 4 * bs) {
+    fprintf(stderr, "ERROR: hole after the first data at %d, not %d\n", n, 4 * bs);
+    error_count++;
+  }
+  if ((n = sfs_seek_data(fs, fd, 4 * bs)) != 8 * bs) {
+    fprintf(stderr, "ERROR: second data at %d, not %d\n", n, 8 * bs);
+    error_count++;
+  }
+  if ((n = sfs_seek_hole(fs, fd, 8 * bs)) != 8 * bs + 10) {
+    fprintf(stderr, "ERROR: hole at the end of the file at %d, not %d\n", n, 8 * bs + 10);
+    error_count++;
+  }
+  if ((n = sfs_seek_data(fs, fd, 8 * bs + 10)) != -1) {
+    fprintf(stderr, "ERROR: data found at %d past the end of the file\n", n);
+    error_count++;
+  }
+
+  sfs_seek(fs, fd, 0);
+  memset(buf, 1, sizeof(buf));
+  n = sfs_read(fs, fd, buf, sizeof(buf));
+  if (n != 8 * bs + 10) {
+    fprintf(stderr, "ERROR: read %d bytes of a sparse file\n", n);
+    error_count++;
+  }
+  for (i = 0; i < n; i++) {
+    int written = (i >= 3 * bs - 100 && i < 3 * bs + 100) || i >= 8 * bs;
+    if (buf[i] != (written ? 'd' : 0)) {
+      fprintf(stderr, "ERROR: byte %d of a sparse file is %d\n", i, buf[i]);
+      error_count++;
+      break;
+    }
+  }
+
+  sfs_close(fs, fd);
+  remove_volume(fs, image);
+  return error_count;
+}
+
+/* test_inline_growth() - grow a small file out of its inode.
+ *
+ * A file up to INODE_INLINE bytes lives in the inode. Writes that take it
+ * to exactly that size, then one byte over, then well past a block must
+ * all read back, before and after a remount.
+ */
+int test_inline_growth(char *image)
+{
+  static char buf[4 * INODE_INLINE];
+  int error_count = 0;
+  int fd, i, n, pass;
+  sfs_t *fs;
+
+  for (i = 0; i < (int)sizeof(buf); i++) {
+    buf[i] = test_str[i % strlen(test_str)];
+  }
+
+  fs = mount_volume(image, 1, NULL);
+  if (fs == NULL) {
+    remove_image(image);
+    return 1;
+  }
+
+  fd = sfs_open(fs, "SMALL.TXT");
+  sfs_write(fs, fd, buf, INODE_INLINE - 16);
+  sfs_write(fs, fd, buf + INODE_INLINE - 16, 16);
+  if ((n = sfs_size(fs, "SMALL.TXT")) != INODE_INLINE) {
+    fprintf(stderr, "ERROR: inline file has size %d, not %d\n", n, INODE_INLINE);
+    error_count++;
+  }
+  sfs_write(fs, fd, buf + INODE_INLINE, 1);
+  sfs_write(fs, fd, buf + INODE_INLINE + 1, sizeof(buf) - INODE_INLINE - 1);
+  sfs_close(fs, fd);
+
+  for (pass = 0; pass < 2; pass++) {
+    if (pass == 1 && (fs = remount_volume(fs, image, NULL)) == NULL) {
+      remove_image(image);
+      return error_count + 1;
+    }
+    error_count += check_file(fs, "SMALL.TXT", buf, sizeof(buf));
+  }
+
+  remove_volume(fs, image);
+  return error_count;
+}
+
+/* test_geometry_remount() - remount a volume of a non-default geometry.
+ *
+ * A volume formatted with larger blocks, more of them and its own group
+ * size must come back from sfs_mount() with that geometry, whatever the
+ * defaults are, and with its files intact. It holds no more files than
+ * it was formatted for.
+ */
+int test_geometry_remount(char *image)
+{
+  sfs_geometry geometry = { 4096, 256, 8, 64 };
+  static char buf[10000];
+  char name[MAX_FNAME_LENGTH];
+  int error_count = 0;
+  int fd, i, n;
+  sfs_t *fs;
+
+  fs = sfs_format(image, &geometry, NULL);
+  if (fs == NULL) {
+    fprintf(stderr, "ERROR: could not format a volume of 4096 byte blocks\n");
+    remove_image(image);
+    return 1;
+  }
+  for (i = 0; i < geometry.num_inodes - 1; i++) {
+    sprintf(name, "GEOM%d.TXT", i);
+    memset(buf, 'a' + i, sizeof(buf));
+    fd = sfs_open(fs, name);
+    sfs_write(fs, fd, buf, sizeof(buf) - i);
+    sfs_close(fs, fd);
+  }
+
+  fs = remount_volume(fs, image, NULL);
+  if (fs == NULL) {
+    remove_image(image);
+    return error_count + 1;
+  }
+  if ((n = disk_block_size(sfs_disk(fs))) != geometry.block_size) {
+    fprintf(stderr, "ERROR: remounted volume has %d byte blocks\n", n);
+    error_count++;
+  }
+  for (i = 0; i < geometry.num_inodes - 1; i++) {
+    sprintf(name, "GEOM%d.TXT", i);
+    memset(buf, 'a' + i, sizeof(buf));
+    error_count += check_file(fs, name, buf, sizeof(buf) - i);
+  }
+  if (sfs_open(fs, "EXTRA.TXT") >= 0) {
+    fprintf(stderr, "ERROR: remounted volume holds more files than formatted for\n");
+    error_count++;
+  }
+
+  remove_volume(fs, image);
+  return error_count;
+}
+
 /* The main testing program
  */
 int
@@ -424,6 +1372,43 @@ main(int argc, char **argv)
 	  error_count++;
   }
  
+  printf("Writing blocks to a fresh image and reading them back.\n");
+  error_count += test_disk_round_trip("sfs_test_disk.disk", DISK_PIO);
+  printf("Same with the image mapped.\n");
+  error_count += test_disk_round_trip("sfs_test_disk.disk", DISK_MMAP);
+  printf("Same with the page cache bypassed.\n");
+  error_count += test_disk_round_trip("sfs_test_disk.disk", DISK_DIRECT);
+  printf("Striping an image over three files.\n");
+  set_stripe_unit(4);
+  error_count += test_disk_round_trip("sfs_test_a.disk:sfs_test_b.disk:sfs_test_c.disk", DISK_PIO);
+  error_count += test_disk_round_trip("sfs_test_a.disk:sfs_test_b.disk:sfs_test_c.disk", DISK_MMAP);
+  set_stripe_unit(DISK_STRIPE_UNIT);
+  error_count += test_stripe_layout("sfs_test_a.disk:sfs_test_b.disk:sfs_test_c.disk");
+  printf("Formatting an image over an old one.\n");
+  error_count += test_fresh_image("sfs_test_disk.disk");
+  printf("Keeping a batch of block requests in flight.\n");
+  error_count += test_disk_batch("sfs_test_disk.disk");
+  printf("Giving up on requests to a failing device.\n");
+  error_count += test_disk_failure("sfs_test_disk.disk");
+
+  printf("Writing a file to a fresh volume and reading it back.\n");
+  error_count += test_volume_modes();
+  printf("Reading files whose blocks are interleaved.\n");
+  error_count += test_fragmented_reads("sfs_test_volume.disk");
+  printf("Reading and writing while the device fails now and then.\n");
+  error_count += test_short_counts("sfs_test_volume.disk");
+
+  printf("Writing into a block allocated ahead on a mapped image.\n");
+  error_count += test_mmap_fresh_block("sfs_test_volume.disk");
+  printf("Reading a range allocated ahead and never written.\n");
+  error_count += test_allocated_unwritten("sfs_test_volume.disk");
+  printf("Looking for the data and the holes of a sparse file.\n");
+  error_count += test_sparse_boundaries("sfs_test_volume.disk");
+  printf("Growing a file past what its inode holds.\n");
+  error_count += test_inline_growth("sfs_test_volume.disk");
+  printf("Remounting a volume that is not of the default geometry.\n");
+  error_count += test_geometry_remount("sfs_test_volume.disk");
+
   fprintf(stderr, "Test program exiting with %d errors\n", error_count);
   return (error_count);
 }